@@ -2,6 +2,42 @@
 
 //This exercise show how to schedule threads with Rate Monotonic with aperiodic tasks in background
 
+//The task set is described by a table loaded from a configuration file
+//(tasks.conf by default, or the file given as first argument; see tasks.conf
+//for the format). Every task runs the same thread body, periodic or aperiodic,
+//so task sets of any size can be run without editing the code.
+//
+//usage: Tasks [-e | -p ffd|wfd [-u] [-c ncpus]] [-w runs] [-x] [-m margin] [-P]
+//             [-o skip|catchup|abort] [-r secs] [-H file] [-T file] [-L]
+//             [-R none|pi|pcp|srp] [config]
+//  -e         run the periodic tasks under SCHED_DEADLINE (EDF) instead of
+//             SCHED_FIFO with rate monotonic priorities
+//  -p ffd|wfd partition the periodic tasks over the CPUs, first fit or worst
+//             fit by decreasing utilization, instead of using the cpu column
+//  -u         with -p, accept a CPU by the Liu-Layland bound instead of by
+//             response time analysis
+//  -c ncpus   with -p, CPUs to use (default all the online ones)
+//  -w runs    measure the WCET of each task over this many runs (default 1)
+//  -x         cold runs: flush the caches before every run
+//  -m margin  safety margin in percent added to the measured WCET (default
+//             0, 20 under -e, where the WCET is also the runtime)
+//  -P         only profile the WCET, do not run the task set
+//  -o policy  what a periodic task does when a job overruns: skip the
+//             releases already past, catch up by running them late
+//             (default), or abort the job at its deadline
+//  -r secs    print the counters of the tasks every secs seconds while
+//             they run
+//  -H file    write the latency histograms of the tasks to file, JSON if
+//             its name ends in .json, CSV otherwise, at exit and on SIGUSR1
+//  -T file    trace releases, activations, starts, preemptions and ends of
+//             the jobs to file, for tdtrace
+//  -L         lock all the memory of the process and prefault the stacks and
+//             the buffers before the tasks start, so that the jobs take no
+//             page fault
+//  -R proto   protocol of the shared resources (uses=): none, priority
+//             inheritance (default), priority ceiling or stack resource
+//             policy; only pi and none under -e
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,70 +45,398 @@
 #include <unistd.h>
 #include <math.h>
 #include <sys/types.h>
-#include <sys/types.h>
 
 #include <string.h>
 
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "taskdriver.h"
+#include "tdsession.h"
+#include "actq.h"
+#include "workload.h"
+#include "hdr.h"
+#include "tdtrace.h"
+#include "samples.h"
+
+
+#define MAXTASKS (TASKDRIVER_MAX_TASKS - 1)	//task ids are 1 .. MAXTASKS
+#define NJOBS 100	//jobs run by each periodic task
+#define ACT_BATCH 16	//activations an aperiodic task takes at once
+
+#define PERIODIC 'P'
+#define APERIODIC 'A'
+
+//servers of aperiodic tasks
+#define POLLING 1
+#define DEFERRABLE 2
+#define SPORADIC 3
+
+//overrun policies of the periodic tasks, -o
+#define CATCH_UP 0
+#define SKIP 1
+#define ABORT 2
+
+//counters of a task, written only by the thread of the task and read while
+//it runs by the reporter. They sit on cache lines of their own, so that the
+//reads do not disturb what the task writes next to them, and are stored and
+//loaded with relaxed atomics: no lock on either side and no torn value.
+struct task_counters {
+	long int jobs;		//jobs completed or aborted
+	long int missed;	//jobs not completed by their absolute deadline
+	long int aborted;	//jobs aborted at their deadline, -o abort
+	long int skipped;	//releases skipped after an overrun, -o skip
+	long int lateness_sum, lateness_max;	//of the missed jobs, in ns
+	long int delay_sum, delay_max;	//wake up delay after each release, in ns
+	long int response_max;	//largest response time measured, in ns
+	long int minflt, majflt;	//page faults in the periodic loop
+	long int allocs;	//memory allocations in the periodic loop
+	long int lock_errors;	//critical sections skipped, their lock failed
+} __attribute__((aligned(64)));
+
+//the counters of a task have a single writer, its thread, so an update is a
+//plain read and an atomic store, not a locked read-modify-write
+static inline void counter_add(long int *c, long int n)
+{
+	__atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
 
-//code of periodic tasks
-void task1_code( );
-void task2_code( );
-void task3_code( );
+static inline void counter_max(long int *c, long int v)
+{
+	if (v > *c)
+		__atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
 
-//code of aperiodic tasks
-void task4_code( );
+static inline long int counter_read(const long int *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+//latency histograms of each task, in ns: from the release (the activation
+//for aperiodic tasks) to the wake up of the thread, to the start of the job
+//and to its completion. An aperiodic task wakes up for an activation when
+//it takes it from its queue.
+#define HIST_RELEASE 0
+#define HIST_START 1
+#define HIST_RESPONSE 2
+#define NHIST 3
+
+static const char *const hist_names[NHIST] = { "release", "start", "response" };
+
+//shared resources, numbered 1 .. MAXRES, and the protocols of their mutexes
+#define MAXRES 16
+#define MAXUSES 4	//resources a task can use
+#define PROTO_NONE 0
+#define PROTO_PI 1
+#define PROTO_PCP 2
+#define PROTO_SRP 3
+
+//descriptor of a task, one line of the configuration file
+struct task {
+	int id;			//id written to the driver, 1 for the first task
+	char type;		//PERIODIC or APERIODIC
+	long int period;	//in nanoseconds, 0 for aperiodic tasks
+	long int deadline;	//relative deadline in nanoseconds, 0 for none
+	int outer, inner;	//workload: outer chunks of inner kernel iterations
+	int kernel;		//workload kernel, WL_ALU by default
+	long int wss;		//working set of the memory kernels, in bytes
+	long int exec;		//execution time the workload is sized to, in ns,
+				//0 to take outer and inner as they are
+	int cpu;		//processor the thread runs on
+	int priority;		//SCHED_FIFO priority, 0 to assign it by rate monotonic
+	int activates;		//id of the aperiodic task this one activates, 0 for none
+	long int blocking;	//worst case blocking by lower priority tasks, in ns
+	long int jitter;	//worst case release jitter, in ns
+	int server;		//aperiodic tasks: POLLING, DEFERRABLE, SPORADIC or 0
+	long int budget;	//server capacity per period, in ns; the period is
+				//the replenishment period of the server
+	struct { int res; long int cs; } uses[MAXUSES];	//critical sections of
+				//each job: resource and length in ns of CPU time
+	int nuses;
+
+	//filled in at run time
+	struct timespec next_arrival_time;
+	struct actq *queue;	//aperiodic tasks: activations waiting to be served
+	double WCET;
+	double response;	//worst case response time from the analysis, in ns
+	struct task_counters counters;
+	struct hdr *hist;	//NHIST histograms, written only by the task thread
+	pthread_attr_t attributes;
+	pthread_t thread_id;
+	struct sched_param parameters;
+};
+
+struct task tasks[MAXTASKS];
+int ntasks;
+int nperiodic;
+
+//set while the WCET are measured, so that no activation is posted
+int measuring;
+
+//trace session of the calling thread, opened once on the channel of its task
+__thread struct td_session session;
+
+//workload kernel of the calling thread, with its own generator and memory
+__thread struct wl_ctx workload;
+
+//WCET profiler options
+int wcet_runs = 1;
+int cold;
+double margin = -1;	//-1 until given with -m
+int profile_only;
+
+//margin added to the WCET under -e when -m is not given: the WCET is also
+//the SCHED_DEADLINE runtime, and a job that runs past it is throttled
+#define EDF_MARGIN 20
+
+//run the periodic tasks under SCHED_DEADLINE, -e
+int edf;
+
+//partitioning options
+#define FIRST_FIT 1
+#define WORST_FIT 2
+int partitioning;
+int util_test;
+int ncpus;
+
+//overrun policy, -o, and interval of the live report in seconds, -r
+int overrun = CATCH_UP;
+int report;
+
+//where the histograms are written, -H
+const char *hist_file;
+
+//resource protocol, -R, and the mutexes of the resources
+int protocol = PROTO_PI;
+pthread_mutex_t resources[MAXRES + 1];
+
+//lock and prefault the memory, -L
+int lock_memory;
+#define TASK_STACK (256 * 1024)		//stack of the task threads with -L
+#define STACK_PREFAULT (192 * 1024)	//part of it touched before the first job
+
+//task whose thread is in its periodic loop, where nothing should allocate
+__thread struct task *hot_task;
+
+//binary trace of the run, -T, one stream per task
+#define TRACE_SLOTS 65536
+struct tdtrace_header *trace;
+
+//job running on each CPU as the trace last saw it, task << 32 | job: a job
+//that starts on a CPU where another one is running preempts it. A job
+//gives the CPU back when it ends and before it blocks on a resource, so a
+//job that waits is not taken for preempted. This needs the threads to stay
+//on their CPU: under global EDF (-e) no preemption is recorded.
+#define MAXCPUS 256
+struct cpu_running {
+	unsigned long job;
+} __attribute__((aligned(64)));
+struct cpu_running running[MAXCPUS];
+
+//the CPU the job of the calling thread holds in running[], -1 for none,
+//its entry there and the job it preempted
+__thread int running_cpu = -1;
+__thread unsigned long running_me, running_prev;
+
+//record an event in the trace stream of task t, the calling thread's own;
+//ts 0 is now
+static inline void trace_event(struct task *t, int task, int type, int job, int arg,
+			       long int ts)
+{
+	if (trace)
+		tdtrace_record(trace, t - tasks, task, type, job, arg, ts);
+}
 
+//measure the WCET of a task over wcet_runs runs of its workload
+void profile_task(struct task *t);
 
-//characteristic function of the thread, only for timing and synchronization
-//periodic tasks
-void *task1( void *);
-void *task2( void *);
-void *task3( void *);
+//rate monotonic priorities for the tasks whose priority is not given
+void assign_priorities(int priomax, int priomin);
 
-//aperiodic tasks
-void *task4( void *);
+//schedulability tests of the periodic tasks, 0 if they pass
+int schedulable();
+int edf_schedulable();
 
+//assign the periodic tasks to the CPUs, 0 if they all fit
+int partition();
 
-// initialization of mutexes and conditions (only for aperiodic scheduling)
-pthread_mutex_t mutex_task_4 = PTHREAD_MUTEX_INITIALIZER;
+//add the blocking on the shared resources to that of each task
+void resource_blocking();
 
-pthread_cond_t cond_task_4 = PTHREAD_COND_INITIALIZER;
+//create the mutexes of the resources for the chosen protocol; -1 on error
+int init_resources();
 
+//make the calling thread a SCHED_DEADLINE task with the parameters of t
+int set_deadline(struct task *t);
 
+//whether a task takes part in the schedulability analysis
+static int analysed(const struct task *t);
 
-#define INNERLOOP 1000
-#define OUTERLOOP 100
 
-#define NPERIODICTASKS 3
-#define NAPERIODICTASKS 1
-#define NTASKS NPERIODICTASKS + NAPERIODICTASKS
+//read the task set from a configuration file
+int load_tasks(const char *path);
 
-long int periods[NTASKS];
-struct timespec next_arrival_time[NTASKS];
-double WCET[NTASKS];
-pthread_attr_t attributes[NTASKS];
-pthread_t thread_id[NTASKS];
-struct sched_param parameters[NTASKS];
-int missed_deadlines[NTASKS];
+//task set used when there is no configuration file
+void default_tasks();
 
+//code of all tasks; returns 0 if the job was aborted at its deadline
+int task_code(struct task *t, int job);
 
+//characteristic functions of the threads, only for timing and synchronization
+void *periodic_task(void *);
+void *aperiodic_task(void *);
 
-int main()
+//open the driver channel a task writes its markers to
+int open_channel(int task);
+
+//write every page of a buffer, so that it is mapped before it is used
+void prefault(void *p, size_t len);
+
+//activate an aperiodic task; job is passed along as the payload
+void activate(int task, int source, int job);
+
+//print the counters of the tasks while they run, every report seconds
+void *reporter(void *);
+
+//print the percentiles of the latencies of the tasks, and write their
+//histograms to hist_file if there is one
+void dump_histograms();
+
+//dump the histograms at every SIGUSR1
+void *dumper(void *);
+
+
+
+static void usage(const char *prog)
 {
-  	// set task periods in nanoseconds
-	//the first task has period 100 millisecond
-	//the second task has period 200 millisecond
-	//the third task has period 400 millisecond
-	//you can already order them according to their priority; 
-	//if not, you will need to sort them
-  	periods[0]= 300000000; //in nanoseconds
-  	periods[1]= 500000000; //in nanoseconds
-  	periods[2]= 800000000; //in nanoseconds
-	
-  	//for aperiodic tasks we set the period equals to 0
-  	periods[3]= 0; 
+	fprintf(stderr, "usage: %s [-e | -p ffd|wfd [-u] [-c ncpus]] [-w runs] [-x] [-m margin] [-P]\n"
+		"\t[-o skip|catchup|abort] [-r secs] [-H file] [-T file] [-L] [-R none|pi|pcp|srp] [config]\n",
+		prog);
+	exit(-1);
+}
 
+int main(int argc, char **argv)
+{
+	const char *trace_file = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ep:uc:w:xm:Po:r:H:T:LR:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			if (strcmp(optarg, "ffd") == 0)
+				partitioning = FIRST_FIT;
+			else if (strcmp(optarg, "wfd") == 0)
+				partitioning = WORST_FIT;
+			else
+				usage(argv[0]);
+			break;
+		case 'u':
+			util_test = 1;
+			break;
+		case 'c':
+			ncpus = atoi(optarg);
+			break;
+		case 'e':
+			edf = 1;
+			break;
+		case 'w':
+			wcet_runs = atoi(optarg);
+			break;
+		case 'x':
+			cold = 1;
+			break;
+		case 'm':
+			if ((margin = atof(optarg)) < 0)
+				usage(argv[0]);
+			break;
+		case 'P':
+			profile_only = 1;
+			break;
+		case 'o':
+			if (strcmp(optarg, "skip") == 0)
+				overrun = SKIP;
+			else if (strcmp(optarg, "catchup") == 0)
+				overrun = CATCH_UP;
+			else if (strcmp(optarg, "abort") == 0)
+				overrun = ABORT;
+			else
+				usage(argv[0]);
+			break;
+		case 'r':
+			report = atoi(optarg);
+			if (report < 1)
+				usage(argv[0]);
+			break;
+		case 'H':
+			hist_file = optarg;
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'L':
+			lock_memory = 1;
+			break;
+		case 'R':
+			if (strcmp(optarg, "none") == 0)
+				protocol = PROTO_NONE;
+			else if (strcmp(optarg, "pi") == 0)
+				protocol = PROTO_PI;
+			else if (strcmp(optarg, "pcp") == 0)
+				protocol = PROTO_PCP;
+			else if (strcmp(optarg, "srp") == 0)
+				protocol = PROTO_SRP;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	//SCHED_DEADLINE threads have no priority to raise to a ceiling
+	if (wcet_runs < 1 || optind < argc - 1 || ncpus < 0 ||
+	    (edf && partitioning) || (edf && protocol >= PROTO_PCP))
+		usage(argv[0]);
+	if (ncpus == 0)
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (margin < 0)
+		margin = edf ? EDF_MARGIN : 0;
+
+	//with -L every page the process has or will map stays in memory, and
+	//freed memory is kept by malloc instead of being given back and faulted
+	//in again
+	if (lock_memory)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			perror("mlockall");
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+	}
+
+	//SIGUSR1 is taken by the dumper only, the tasks inherit the mask; until
+	//the dumper runs, it is kept pending
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+	const char *config = optind < argc ? argv[optind] : "tasks.conf";
+
+	if (load_tasks(config) == -1)
+	{
+		//the default file is optional, one given explicitly is not
+		if (optind < argc)
+			return(-1);
+		default_tasks();
+	}
+	printf("%d tasks, %d periodic\n", ntasks, nperiodic);
 
 	//this is not strictly necessary, but it is convenient to
 	//assign a name to the maximum and the minimum priotity in the
@@ -90,142 +454,186 @@ int main()
   	if (getuid() == 0)
     		pthread_setschedparam(pthread_self(),SCHED_FIFO,&priomax);
 
-  	// execute all tasks in standalone modality in order to measure execution times
-  	// (use gettimeofday). Use the computed values to update the worst case execution
-  	// time of each task.
+  	// execute all tasks in standalone modality in order to measure execution times.
+  	// Use the computed values to update the worst case execution time of each task.
 
  	int i;
-  	for (i =0; i < NTASKS; i++)
-    	{
-
-		// initializa time_1 and time_2 required to read the clock
-		struct timespec time_1, time_2;
-		clock_gettime(CLOCK_REALTIME, &time_1);
-
-		//we should execute each task more than one for computing the WCET
-		//periodic tasks
- 	     	if (i==0)
-			task1_code();
-      		if (i==1)
-			task2_code();
-      		if (i==2)
-			task3_code();
-    		
-      		//aperiodic tasks
-      		if (i==3)
-			task4_code();
-
-		clock_gettime(CLOCK_REALTIME, &time_2);
-
-
-		// compute the Worst Case Execution Time (in a real case, we should repeat this many times under
-		//different conditions, in order to have reliable values
-
-      		WCET[i]= 1000000000*(time_2.tv_sec - time_1.tv_sec)
-			       +(time_2.tv_nsec-time_1.tv_nsec);
-      		printf("\nWorst Case Execution Time %d=%f \n", i, WCET[i]);
-    	}
+	cpu_set_t all_cpus;
+	sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+	measuring = 1;
+  	for (i =0; i < ntasks; i++)
+		profile_task(&tasks[i]);
+	measuring = 0;
+	sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+	if (profile_only)
+		return(0);
+
+	assign_priorities(priomax.sched_priority, priomin.sched_priority);
+	resource_blocking();
+
+	if (partitioning && partition() != 0)
+	{
+		printf("\n The task set does not fit on %d CPUs\n", ncpus);
+		return(-1);
+	}
+	if (init_resources() != 0)
+		return(-1);
 
-    	// compute U
-	double U = WCET[0]/periods[0]+WCET[1]/periods[1]+WCET[2]/periods[2];
-
-    	// compute Ulub by considering the fact that we have harmonic relationships between periods
-	//double Ulub = 1;
-    	
-	//if there are no harmonic relationships, use the following formula instead
-	double Ulub = NPERIODICTASKS*(pow(2.0,(1.0/NPERIODICTASKS)) -1);
-	
-	//check the sufficient conditions: if they are not satisfied, exit  
-  	if (U > Ulub)
+	//check the schedulability of the task set: if it is not schedulable, exit
+  	if ((edf ? edf_schedulable() : schedulable()) != 0)
     	{
-      		printf("\n U=%lf Ulub=%lf Non schedulable Task Set", U, Ulub);
+      		printf("\n Non schedulable Task Set\n");
       		return(-1);
     	}
-  	printf("\n U=%lf Ulub=%lf Scheduable Task Set", U, Ulub);
+  	printf("\n Scheduable Task Set");
   	fflush(stdout);
   	sleep(5);
 
-  	// set the minimum priority to the current thread: this is now required because 
+  	// set the minimum priority to the current thread: this is now required because
 	//we will assign higher priorities to periodic threads to be soon created
 	//pthread_setschedparam
 
   	if (getuid() == 0)
     		pthread_setschedparam(pthread_self(),SCHED_FIFO,&priomin);
 
-  
+
   	// set the attributes of each task, including scheduling policy and priority
-  	for (i =0; i < NPERIODICTASKS; i++)
+  	for (i =0; i < ntasks; i++)
     	{
 		//initializa the attribute structure of task i
-      		pthread_attr_init(&(attributes[i]));
+      		pthread_attr_init(&(tasks[i].attributes));
+      		tasks[i].parameters.sched_priority = tasks[i].priority;
+		if (lock_memory)
+			pthread_attr_setstacksize(&(tasks[i].attributes), TASK_STACK);
+
+		//without privileges the threads inherit the policy of the main thread,
+		//an explicit SCHED_FIFO would make pthread_create fail. Under EDF the
+		//periodic and server threads switch to SCHED_DEADLINE themselves.
+		if (getuid() != 0 || (edf && analysed(&tasks[i])))
+			continue;
 
 		//set the attributes to tell the kernel that the priorities and policies are explicitly chosen,
-		//not inherited from the main thread (pthread_attr_setinheritsched) 
-      		pthread_attr_setinheritsched(&(attributes[i]), PTHREAD_EXPLICIT_SCHED);
-      
-		// set the attributes to set the SCHED_FIFO policy (pthread_attr_setschedpolicy)
-		pthread_attr_setschedpolicy(&(attributes[i]), SCHED_FIFO);
+		//not inherited from the main thread (pthread_attr_setinheritsched)
+      		pthread_attr_setinheritsched(&(tasks[i].attributes), PTHREAD_EXPLICIT_SCHED);
 
-		//properly set the parameters to assign the priority inversely proportional 
-		//to the period
-      		//parameters[i].sched_priority = priomin.sched_priority+NTASKS - i;
-      		parameters[i].sched_priority = sched_get_priority_max(SCHED_FIFO) - i;
+		// set the attributes to set the SCHED_FIFO policy (pthread_attr_setschedpolicy)
+		pthread_attr_setschedpolicy(&(tasks[i].attributes), SCHED_FIFO);
 
 		//set the attributes and the parameters of the current thread (pthread_attr_setschedparam)
-      		pthread_attr_setschedparam(&(attributes[i]), &(parameters[i]));
+      		pthread_attr_setschedparam(&(tasks[i].attributes), &(tasks[i].parameters));
     	}
 
- 	// aperiodic tasks
-  	for (int i =NPERIODICTASKS; i < NTASKS; i++)
-    	{
-      		pthread_attr_init(&(attributes[i]));
-      		pthread_attr_setschedpolicy(&(attributes[i]), SCHED_FIFO);
-
-      		//set minimum priority (background scheduling)
-      		parameters[i].sched_priority = 0;
-      		pthread_attr_setschedparam(&(attributes[i]), &(parameters[i]));
-    	}
 
+	//the trace is created now so that the profiling runs are not in it
+	if (trace_file)
+	{
+		if ((trace = tdtrace_create(trace_file, ntasks, TRACE_SLOTS)) == NULL)
+		{
+			perror(trace_file);
+			return(-1);
+		}
+		for (i = 0; i < ntasks; i++)
+		{
+			struct tdtrace_stream *s = tdtrace_stream(trace, i);
 
-	//delare the variable to contain the return values of pthread_create	
-  	int iret[NTASKS];
+			s->task = tasks[i].id;
+			s->period_ns = tasks[i].type == PERIODIC ? tasks[i].period : 0;
+			s->deadline_ns = tasks[i].deadline;
+		}
+		//the histograms and the queues were cleared when they were allocated,
+		//the trace is a file: write its pages once to map them writable
+		if (lock_memory)
+			prefault(trace, tdtrace_size(ntasks, TRACE_SLOTS));
+	}
 
 	//declare variables to read the current time
 	struct timespec time_1;
-	clock_gettime(CLOCK_REALTIME, &time_1);
+	clock_gettime(CLOCK_MONOTONIC, &time_1);
 
   	// set the next arrival time for each task. This is not the beginning of the first
-	// period, but the end of the first period and beginning of the next one. 
-  	for (i = 0; i < NPERIODICTASKS; i++)
+	// period, but the end of the first period and beginning of the next one.
+  	for (i = 0; i < ntasks; i++)
     	{
-		long int next_arrival_nanoseconds = time_1.tv_nsec + periods[i];
+		long int next_arrival_nanoseconds = time_1.tv_nsec + tasks[i].period;
 		//then we compute the end of the first period and beginning of the next one
-		next_arrival_time[i].tv_nsec= next_arrival_nanoseconds%1000000000;
-		next_arrival_time[i].tv_sec= time_1.tv_sec + next_arrival_nanoseconds/1000000000;
-       	missed_deadlines[i] = 0;
+		tasks[i].next_arrival_time.tv_nsec= next_arrival_nanoseconds%1000000000;
+		tasks[i].next_arrival_time.tv_sec= time_1.tv_sec + next_arrival_nanoseconds/1000000000;
+		memset(&tasks[i].counters, 0, sizeof(tasks[i].counters));
+		if (tasks[i].type == APERIODIC && (tasks[i].queue = actq_create()) == NULL)
+		{
+			perror("activation queue");
+			return(-1);
+		}
+		if ((tasks[i].hist = hdr_create(NHIST)) == NULL)
+		{
+			perror("histograms");
+			return(-1);
+		}
     	}
 
-	
 
-	// create all threads(pthread_create)
-  	iret[0] = pthread_create( &(thread_id[0]), &(attributes[0]), task1, NULL);
-  	iret[1] = pthread_create( &(thread_id[1]), &(attributes[1]), task2, NULL);
-  	iret[2] = pthread_create( &(thread_id[2]), &(attributes[2]), task3, NULL);
-   	iret[3] = pthread_create( &(thread_id[3]), &(attributes[3]), task4, NULL);
-
-  	// join all threads (pthread_join)
-  	pthread_join( thread_id[0], NULL);
-  	pthread_join( thread_id[1], NULL);
-  	pthread_join( thread_id[2], NULL);
 
+	// create all threads(pthread_create)
+  	for (i = 0; i < ntasks; i++)
+	{
+		int iret = pthread_create(&(tasks[i].thread_id), &(tasks[i].attributes),
+					  tasks[i].type == PERIODIC ? periodic_task : aperiodic_task,
+					  &tasks[i]);
+		if (iret != 0)
+			fprintf(stderr, "task %d: pthread_create failed: %s\n",
+				tasks[i].id, strerror(iret));
+	}
 
-  	// set the next arrival time for each task. This is not the beginning of the first
-	// period, but the end of the first period and beginning of the next one. 
-  	for (i = 0; i < NTASKS; i++)
+	//the reporter and the dumper run at the priority of the main thread,
+	//below all tasks
+	pthread_t report_thread, dump_thread;
+	if (report && pthread_create(&report_thread, NULL, reporter, NULL) != 0)
+		fprintf(stderr, "cannot start the reporter\n");
+	if (pthread_create(&dump_thread, NULL, dumper, NULL) != 0)
+		fprintf(stderr, "cannot start the dumper\n");
+
+  	// join the periodic threads (pthread_join), the aperiodic ones never end
+  	for (i = 0; i < ntasks; i++)
+		if (tasks[i].type == PERIODIC)
+			pthread_join(tasks[i].thread_id, NULL);
+
+
+  	// print the missed deadlines of each task and by how much they were
+	// missed, the delay between the release of a periodic task and the
+	// moment it actually woke up, and its largest response time next to
+	// the worst case computed by the analysis
+  	for (i = 0; i < ntasks; i++)
     	{
-      		printf ("\nMissed Deadlines Task %d=%d", i, missed_deadlines[i]);
+		//the aperiodic tasks are still running: take a snapshot
+		struct task_counters snap, *c = &snap;
+		long int *from = (long int *)&tasks[i].counters, *to = (long int *)&snap;
+		for (unsigned int k = 0; k < sizeof(snap) / sizeof(long int); k++)
+			to[k] = counter_read(&from[k]);
+
+      		printf ("\nMissed Deadlines Task %d=%ld", tasks[i].id, c->missed);
+		if (c->missed)
+			printf("  lateness us avg %.1f max %.1f",
+			       (double)c->lateness_sum / c->missed / 1000, c->lateness_max / 1000.0);
+		if (c->aborted || c->skipped)
+			printf("  aborted %ld skipped %ld", c->aborted, c->skipped);
+		if (c->lock_errors)
+			printf("  critical sections skipped, lock failed: %ld (!)", c->lock_errors);
+		if (tasks[i].type == PERIODIC && (lock_memory || c->minflt || c->majflt || c->allocs))
+			printf("  in the loop: page faults %ld minor %ld major, %ld allocations%s",
+			       c->minflt, c->majflt, c->allocs,
+			       c->minflt || c->majflt || c->allocs ? " (!)" : "");
+		if (tasks[i].type == PERIODIC && c->jobs)
+			printf("  wake up delay us avg %.1f max %.1f  response us max %.1f analysis %.1f",
+			       (double)c->delay_sum / c->jobs / 1000, c->delay_max / 1000.0,
+			       c->response_max / 1000.0, tasks[i].response / 1000);
+		else if (tasks[i].type == APERIODIC)
+			printf("  %ld activations served, %u lost, response us max %.1f",
+			       c->jobs, __atomic_load_n(&tasks[i].queue->dropped, __ATOMIC_RELAXED),
+			       c->response_max / 1000.0);
 		fflush(stdout);
     	}
+	printf("\n");
+	dump_histograms();
   	exit(0);
 }
 
@@ -235,341 +643,1600 @@ int main()
 
 
 
-void task1_code()
+// One task per line, fields separated by blanks; '#' starts a comment:
+//
+//   type period_us deadline_us outer inner cpu priority activates [options]
+//
+// type is P (periodic) or A (aperiodic, period 0). A deadline of 0 is the
+// period for periodic tasks and none for aperiodic ones. priority 0 means
+// rate monotonic for periodic tasks and background for aperiodic ones.
+// activates is the id of an aperiodic task to activate, 0 for none.
+// Ids follow the order of the file. The options are name=value:
+//
+//   copies=N       the line describes N identical tasks, for large task sets
+//                  (a bare number is taken as copies too)
+//   blocking=us    longest time the task can be blocked by lower priority ones
+//   jitter=us      largest delay of a release after its nominal time
+//   server=ps|ds|ss  aperiodic tasks: serve the activations with a polling,
+//                  deferrable or sporadic server instead of in background
+//   budget=us      capacity of the server
+//   replenish=us   replenishment period of the server
+//   kernel=alu|simd|stream|chase  workload kernel, see workload.h
+//   wss=KB         working set of the stream and chase kernels
+//   exec=us        size the workload to this execution time: inner is
+//                  calibrated at start up, outer is kept (1 if 0)
+//   uses=R:us[,R:us]  each job holds resource R (1 .. 16) for us of CPU
+//                  time, half way through; up to 4 resources, one at a time
+int load_tasks(const char *path)
 {
+	char line[256], type, *opt, name[8];
+	long int period, deadline, value, replenish;
+	int outer, inner, cpu, priority, activates, copies, n, len, lineno = 0;
+	struct task proto;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
 
-	int fd, result, len;
-        const char *str;	
-	
-	
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+	ntasks = nperiodic = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(f)) {
+			fprintf(stderr, "%s:%d: line longer than %d characters\n", path, lineno,
+				(int)sizeof(line) - 2);
+			fclose(f);
+			return -1;
+		}
+		char *c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+		len = 0;
+		n = sscanf(line, " %c %ld %ld %d %d %d %d %d%n", &type, &period, &deadline,
+			   &outer, &inner, &cpu, &priority, &activates, &len);
+		if (n <= 0)
+			continue;	//empty line
+		if (n < 8 || (type != PERIODIC && type != APERIODIC) ||
+		    (type == PERIODIC) != (period > 0) || deadline < 0 ||
+		    outer < 0 || inner < 0 || cpu < 0 || activates < 0 ||
+		    (priority != 0 && (priority < sched_get_priority_min(SCHED_FIFO) ||
+				       priority > sched_get_priority_max(SCHED_FIFO))))
+			goto bad;
+		if (cpu >= CPU_SETSIZE || cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+			fprintf(stderr, "%s:%d: cpu %d is not online\n", path, lineno, cpu);
+			fclose(f);
+			return -1;
+		}
 
-         }
-         str = "[1"; 
-	 len = strlen(str)+1;
-	 
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+		memset(&proto, 0, sizeof(proto));
+		proto.type = type;
+		proto.period = period * 1000;
+		proto.deadline = (deadline ? deadline : period) * 1000;
+		proto.outer = outer;
+		proto.inner = inner;
+		proto.cpu = cpu;
+		proto.priority = priority;
+		proto.activates = activates;
+
+		copies = 1;
+		replenish = 0;
+		for (opt = strtok(line + len, " \t\n"); opt; opt = strtok(NULL, " \t\n")) {
+			value = 0;
+			if (sscanf(opt, "server=%3s", name) == 1) {
+				if (strcmp(name, "ps") == 0)
+					proto.server = POLLING;
+				else if (strcmp(name, "ds") == 0)
+					proto.server = DEFERRABLE;
+				else if (strcmp(name, "ss") == 0)
+					proto.server = SPORADIC;
+				else
+					goto bad;
+			}
+			else if (sscanf(opt, "kernel=%7s", name) == 1) {
+				if ((proto.kernel = wl_kind_of(name)) == -1)
+					goto bad;
+			}
+			else if (strncmp(opt, "uses=", 5) == 0) {
+				for (char *u = opt + 5; *u; ) {
+					int res, used;
+					long int cs;
+					if (proto.nuses == MAXUSES ||
+					    sscanf(u, "%d:%ld%n", &res, &cs, &used) != 2 ||
+					    res < 1 || res > MAXRES || cs <= 0)
+						goto bad;
+					proto.uses[proto.nuses].res = res;
+					proto.uses[proto.nuses].cs = cs * 1000;
+					proto.nuses++;
+					u += used;
+					if (*u == ',')
+						u++;
+					else if (*u)
+						goto bad;
+				}
+			}
+			else if (sscanf(opt, "wss=%ld", &value) == 1)
+				proto.wss = value * 1024;
+			else if (sscanf(opt, "exec=%ld", &value) == 1)
+				proto.exec = value * 1000;
+			else if (sscanf(opt, "budget=%ld", &value) == 1)
+				proto.budget = value * 1000;
+			else if (sscanf(opt, "replenish=%ld", &value) == 1)
+				replenish = value * 1000;
+			else if (sscanf(opt, "copies=%ld", &value) == 1 || sscanf(opt, "%ld", &value) == 1)
+				copies = value;
+			else if (sscanf(opt, "blocking=%ld", &value) == 1)
+				proto.blocking = value * 1000;
+			else if (sscanf(opt, "jitter=%ld", &value) == 1)
+				proto.jitter = value * 1000;
+			else
+				goto bad;
+			if (value < 0)
+				goto bad;
+		}
+		if (copies < 1)
+			goto bad;
+		//the period of a server is its replenishment period
+		if (proto.server) {
+			if (type != APERIODIC || proto.budget <= 0 || replenish <= proto.budget)
+				goto bad;
+			proto.period = replenish;
+		}
 
-         }
+		while (copies--) {
+			if (ntasks == MAXTASKS) {
+				fprintf(stderr, "%s: more than %d tasks\n", path, MAXTASKS);
+				fclose(f);
+				return -1;
+			}
+			tasks[ntasks] = proto;
+			tasks[ntasks].id = ntasks + 1;
+			ntasks++;
+			if (type == PERIODIC)
+				nperiodic++;
+		}
+	}
+	fclose(f);
+
+	//an activation can only go to an aperiodic task of the set
+	for (n = 0; n < ntasks; n++) {
+		activates = tasks[n].activates;
+		if (activates && (activates > ntasks || tasks[activates - 1].type != APERIODIC)) {
+			fprintf(stderr, "%s: task %d activates %d, not an aperiodic task\n",
+				path, tasks[n].id, activates);
+			return -1;
+		}
+	}
+	if (nperiodic == 0) {
+		fprintf(stderr, "%s: no periodic task\n", path);
+		return -1;
+	}
+	return 0;
 
-	 close(fd);
-	 
+bad:
+	fprintf(stderr, "%s:%d: bad task line\n", path, lineno);
+	fclose(f);
+	return -1;
+}
 
+// the original task set: three periodic tasks of 300, 500 and 800 ms on
+// processor 0, the second one activating the aperiodic task 4
+void default_tasks()
+{
+	static const struct { char type; long int period; int outer, inner, activates; } set[] = {
+		{ PERIODIC,  300000000, 100, 1000, 0 },
+		{ PERIODIC,  500000000, 100, 1000, 4 },
+		{ PERIODIC,  800000000, 100, 4000, 0 },
+		{ APERIODIC, 0,         100, 1000, 0 },
+	};
+
+	ntasks = nperiodic = 0;
+	for (unsigned int i = 0; i < sizeof(set) / sizeof(set[0]); i++) {
+		struct task *t = &tasks[ntasks];
+		memset(t, 0, sizeof(*t));
+		t->id = ++ntasks;
+		t->type = set[i].type;
+		t->period = t->deadline = set[i].period;
+		t->outer = set[i].outer;
+		t->inner = set[i].inner;
+		t->activates = set[i].activates;
+		if (t->type == PERIODIC)
+			nperiodic++;
+	}
+}
 
-	int i,j;
-	double uno;
-  	for (i = 0; i < OUTERLOOP; i++)
-    	{
-      		for (j = 0; j < INNERLOOP; j++)
-		{
-			uno = rand()*rand()%10;
-		}
-    	}
-    	
-    	
-    	
-	if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
 
-         }
 
-         str = "1]"; 
-	 len = strlen(str)+1;
-	 
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+// trace channel of task i: /dev/taskdriver<i-1> when the driver is loaded with
+// one channel per task (ndevices=4), otherwise the shared /dev/taskdriver0
+int open_channel(int task)
+{
+	char path[32];
+	int fd;
 
-         }
-	 close(fd);
-	 
+	sprintf(path, "/dev/taskdriver%d", task - 1);
+	if ((fd = open(path, O_RDWR)) == -1)
+		fd = open("/dev/taskdriver0", O_RDWR);
+	return fd;
 }
 
+// the activations of a task are queued, so none is lost if the task is still
+// running the previous one or is not waiting yet. Posting one never blocks:
+// the queue is lock-free and the aperiodic task, whatever its priority, owns
+// nothing the caller could wait for. The activation is traced in the session
+// of the caller.
+void activate(int task, int source, int job)
+{
+	uint32_t seq = actq_push(tasks[task - 1].queue, source, job);
+
+	if (seq)
+	{
+		td_session_record(&session, task, TASKDRIVER_EV_ACTIVATE, seq);
+		trace_event(&tasks[source - 1], task, TASKDRIVER_EV_ACTIVATE, seq, source, 0);
+	}
+}
 
-void *task1( void *ptr )
+
+static long int timespec_ns(const struct timespec *t)
+{
+	return t->tv_sec * 1000000000L + t->tv_nsec;
+}
+
+void prefault(void *p, size_t len)
+{
+	volatile char *c = (volatile char *)p;
+	long int page = sysconf(_SC_PAGESIZE);
+
+	for (size_t off = 0; off < len; off += page)
+		c[off] = c[off];
+}
+
+//touch the stack of the calling thread down to STACK_PREFAULT bytes below
+//this frame, which -L leaves room for
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	volatile char stack[STACK_PREFAULT];
+
+	prefault((void *)stack, sizeof(stack));
+}
+
+//the allocations of a thread in its periodic loop are counted: the loop is
+//meant to allocate nothing, and with -L the check proves it. glibc resolves
+//malloc to these wrappers, its own __libc_ functions do the work.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+	if (hot_task)
+		counter_add(&hot_task->counters.allocs, 1);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (hot_task)
+		counter_add(&hot_task->counters.allocs, 1);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+	if (hot_task)
+		counter_add(&hot_task->counters.allocs, 1);
+	return __libc_realloc(p, size);
+}
+
+static void set_affinity(int cpu)
 {
 	// set thread affinity, that is the processor on which threads shall run
 	cpu_set_t cset;
+	int err;
 	CPU_ZERO (&cset);
-	CPU_SET(0, &cset);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
+	CPU_SET(cpu, &cset);
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset)) != 0)
+		fprintf(stderr, "cannot run on cpu %d: %s\n", cpu, strerror(err));
+}
 
-	int i=0;
-  	for (i=0; i < 100; i++)
-    	{
-      		task1_code();
+//account the wake up of an aperiodic task for the n activations it just
+//took from its queue
+static void activations_taken(struct task *t, const struct actq_record *act, int n)
+{
+	struct timespec now;
 
-		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next_arrival_time[1], NULL);
-		long int next_arrival_nanoseconds = next_arrival_time[1].tv_nsec + periods[1];
-		next_arrival_time[1].tv_nsec= next_arrival_nanoseconds%1000000000;
-		next_arrival_time[1].tv_sec= next_arrival_time[1].tv_sec + next_arrival_nanoseconds/1000000000;
-    	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i = 0; i < n; i++)
+		hdr_record(&t->hist[HIST_RELEASE], timespec_ns(&now) - (long int)act[i].post_ns);
+}
+
+//account the start of a job released at release
+static void job_started(struct task *t, long int release)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hdr_record(&t->hist[HIST_START], timespec_ns(&now) - release);
 }
 
+//account the completion of a job against its absolute deadline
+static void job_done(struct task *t, long int completion, long int release)
+{
+	struct task_counters *c = &t->counters;
+	long int response = completion - release;
+
+	counter_add(&c->jobs, 1);
+	counter_max(&c->response_max, response);
+	hdr_record(&t->hist[HIST_RESPONSE], response);
+	if (t->deadline && response > t->deadline)
+	{
+		counter_add(&c->missed, 1);
+		counter_add(&c->lateness_sum, response - t->deadline);
+		counter_max(&c->lateness_max, response - t->deadline);
+	}
+}
 
 
 
-// application specific task_2 code
-void task2_code()
+//A server is analysed as a periodic task whose execution time is its budget
+//and whose period and deadline are its replenishment period.
+static int analysed(const struct task *t)
 {
+	return t->type == PERIODIC || t->server;
+}
 
+static double task_cost(const struct task *t)
+{
+	return t->server ? t->budget : t->WCET;
+}
 
-	int fd, result, len;
-        const char *str;	
-	
-	//open the driver file
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+static long int task_deadline(const struct task *t)
+{
+	return t->server ? t->period : t->deadline;
+}
 
-         }
-         str = "[2"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+//Release jitter of a task as seen by the lower priority ones. A deferrable
+//server can use its budget at the end of a period and again at the start of
+//the next, which is the interference of a periodic task with jitter T - C.
+static double task_jitter(const struct task *t)
+{
+	return t->server == DEFERRABLE ? t->period - t->budget : t->jitter;
+}
 
-         }
+//The priority is inversely proportional to the period: one below the
+//maximum for each periodic task or server with a shorter period (ties by
+//order). Aperiodic tasks without a server run in background at the
+//minimum priority. When the range runs out the longest periods share the
+//lowest priority above it, and the analysis treats them as interfering
+//with each other.
+void assign_priorities(int priomax, int priomin)
+{
+	int i, j, rank, shared = 0;
 
-	 close(fd);
-	 
+	for (i = 0; i < ntasks; i++)
+	{
+		if (tasks[i].priority == 0 && analysed(&tasks[i]))
+		{
+			rank = 0;
+			for (j = 0; j < ntasks; j++)
+				if (analysed(&tasks[j]) &&
+				    (tasks[j].period < tasks[i].period ||
+				     (tasks[j].period == tasks[i].period && j < i)))
+					rank++;
+			tasks[i].priority = priomax - rank;
+			if (tasks[i].priority <= priomin)
+			{
+				tasks[i].priority = priomin + 1;
+				shared++;
+			}
+		}
+		if (tasks[i].priority == 0)
+			tasks[i].priority = priomin;
+	}
+	if (shared)
+		printf("\n %d tasks are beyond the %d priorities and share priority %d",
+		       shared, priomax - priomin, priomin + 1);
+}
 
+//whether task j can delay task i when both are ready on the same CPU:
+//SCHED_FIFO does not preempt between equal priorities, so a task of the
+//same priority released first runs first, whatever their order
+static int preempts(int j, int i)
+{
+	return analysed(&tasks[j]) && j != i && tasks[j].cpu == tasks[i].cpu &&
+	       tasks[j].priority >= tasks[i].priority;
+}
 
-	
-	
+//Worst case response time of a periodic task or server under fixed
+//priorities. A deadline beyond the period lets a job wait for the previous
+//ones of the same task, so every job q of the level-i busy period
+//  L = B + sum over j in hp(i) and i of ceil((L + Jj) / Tj) * Cj
+//is checked, with w(q) the smallest fixed point of
+//  w = B + (q + 1) C + sum over higher priority j of ceil((w + Jj) / Tj) * Cj
+//and R the largest w(q) - q T. With D <= T only job 0 falls in it. The
+//iterations stop as soon as a job misses its deadline; with a utilization
+//above 1 the busy period never ends and R is infinite.
+double response_time(int i)
+{
+	struct task *t = &tasks[i];
+	double U = task_cost(t) / t->period, L, w, R = 0, prev;
+	int j, q;
+
+	for (j = 0; j < ntasks; j++)
+		if (preempts(j, i))
+			U += task_cost(&tasks[j]) / tasks[j].period;
+	if (U > 1)
+		return INFINITY;
+
+	L = task_cost(t) + t->blocking;
+	prev = 0;
+	while (L != prev)
+	{
+		prev = L;
+		L = t->blocking + ceil((prev + t->jitter) / t->period) * task_cost(t);
+		for (j = 0; j < ntasks; j++)
+			if (preempts(j, i))
+				L += ceil((prev + task_jitter(&tasks[j])) / tasks[j].period) *
+				     task_cost(&tasks[j]);
+	}
 
+	for (q = 0; q * t->period < L + t->jitter; q++)
+	{
+		w = t->blocking + (q + 1) * task_cost(t);
+		prev = 0;
+		while (w != prev && w - q * t->period + t->jitter <= task_deadline(t))
+		{
+			prev = w;
+			w = t->blocking + (q + 1) * task_cost(t);
+			for (j = 0; j < ntasks; j++)
+				if (preempts(j, i))
+					w += ceil((prev + task_jitter(&tasks[j])) / tasks[j].period) *
+					     task_cost(&tasks[j]);
+		}
+		if (w - q * t->period > R)
+			R = w - q * t->period;
+		if (R + t->jitter > task_deadline(t))
+			break;
+	}
+	return R;
+}
 
+//The tasks of each CPU are checked on their own. The Liu-Layland bound
+//  U <= n (2^(1/n) - 1)
+//and the hyperbolic bound
+//  prod (Ui + 1) <= 2
+//are sufficient tests that only hold with deadlines equal to the periods
+//and no blocking nor jitter. Response time analysis decides: the task set
+//is accepted if every R + J is within its deadline. It is exact for
+//independent tasks without jitter, for any deadline; blocking and jitter
+//are worst case bounds, which make it a sufficient test.
+int schedulable()
+{
+	int i, j, n, simple, ret = 0;
+
+	for (i = 0; i < ntasks; i++)
+	{
+		//analyse each CPU once, at its first periodic task or server
+		for (j = 0; j < i; j++)
+			if (analysed(&tasks[j]) && tasks[j].cpu == tasks[i].cpu)
+				break;
+		if (!analysed(&tasks[i]) || j < i)
+			continue;
+
+		double U = 0, H = 1;
+		n = 0;
+		simple = 1;
+		for (j = i; j < ntasks; j++)
+		{
+			if (!analysed(&tasks[j]) || tasks[j].cpu != tasks[i].cpu)
+				continue;
+			U += task_cost(&tasks[j]) / tasks[j].period;
+			H *= task_cost(&tasks[j]) / tasks[j].period + 1;
+			if (task_deadline(&tasks[j]) < tasks[j].period || tasks[j].blocking ||
+			    task_jitter(&tasks[j]))
+				simple = 0;
+			n++;
+		}
+		double Ulub = n*(pow(2.0,(1.0/n)) -1);
+		printf("\n CPU %d: U=%lf Ulub=%lf hyperbolic=%lf", tasks[i].cpu, U, Ulub, H);
+		if (simple && U <= Ulub)
+			printf(" passes the Liu-Layland bound");
+		else if (simple && H <= 2)
+			printf(" passes the hyperbolic bound");
+
+		for (j = i; j < ntasks; j++)
+		{
+			if (!analysed(&tasks[j]) || tasks[j].cpu != tasks[i].cpu)
+				continue;
+			tasks[j].response = response_time(j);
+			printf("\n  %s %d: C=%.1f B=%.1f J=%.1f R=%.1f D=%.1f us%s",
+			       tasks[j].server ? "server" : "task", tasks[j].id,
+			       task_cost(&tasks[j]) / 1000, tasks[j].blocking / 1000.0,
+			       task_jitter(&tasks[j]) / 1000, tasks[j].response / 1000,
+			       task_deadline(&tasks[j]) / 1000.0,
+			       tasks[j].response + tasks[j].jitter > task_deadline(&tasks[j]) ? " MISS" : "");
+			if (tasks[j].response + tasks[j].jitter > task_deadline(&tasks[j]))
+				ret = -1;
+		}
+	}
+	return ret;
+}
 
-	//this double loop with random computation is only required to waste time
-	int i,j;
-	double uno;
-  	for (i = 0; i < OUTERLOOP; i++)
-    	{
-      		for (j = 0; j < INNERLOOP; j++)
+//whether the periodic tasks assigned to a CPU pass its test: every response
+//time within the deadline, or with -u the Liu-Layland bound
+static int cpu_fits(int cpu)
+{
+	double U = 0;
+	int i, n = 0;
+
+	for (i = 0; i < ntasks; i++)
+	{
+		if (!analysed(&tasks[i]) || tasks[i].cpu != cpu)
+			continue;
+		if (util_test)
 		{
-			uno = rand()*rand()%10;
-    		}
-  	}
+			U += task_cost(&tasks[i]) / tasks[i].period;
+			n++;
+		}
+		else if (response_time(i) + tasks[i].jitter > task_deadline(&tasks[i]))
+			return 0;
+	}
+	return !util_test || U <= n*(pow(2.0,(1.0/n)) -1);
+}
 
-  	// when the random variable uno=0, then aperiodic task 4 must
-  	// be executed
-  	if (uno == 0)
-    	{
+static double cpu_utilization(int cpu)
+{
+	double U = 0;
+
+	for (int i = 0; i < ntasks; i++)
+		if (analysed(&tasks[i]) && tasks[i].cpu == cpu)
+			U += task_cost(&tasks[i]) / tasks[i].period;
+	return U;
+}
+
+//The periodic tasks and servers are taken by decreasing utilization and each
+//is put on the first CPU where it fits (first fit), or on the least loaded
+//CPU where it fits (worst fit, which spreads the load). A task fits on a CPU
+//if all the tasks there still pass the test with it. The priorities stay the
+//rate monotonic ones. Background aperiodic tasks keep the CPU of the table.
+int partition()
+{
+	int order[MAXTASKS], n = 0, i, j, k, c, best;
 
+	for (i = 0; i < ntasks; i++)
+		if (analysed(&tasks[i]))
+		{
+			tasks[i].cpu = -1;
+			order[n++] = i;
+		}
+	//insertion sort, by decreasing utilization
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && task_cost(&tasks[order[j]]) / tasks[order[j]].period >
+				     task_cost(&tasks[order[j - 1]]) / tasks[order[j - 1]].period; j--)
+		{
+			k = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = k;
+		}
 
-      		pthread_cond_signal(&cond_task_4);
+	for (i = 0; i < n; i++)
+	{
+		struct task *t = &tasks[order[i]];
 
+		best = -1;
+		for (c = 0; c < ncpus; c++)
+		{
+			t->cpu = -1;
+			if (partitioning == WORST_FIT && best != -1 &&
+			    cpu_utilization(c) >= cpu_utilization(best))
+				continue;
+			t->cpu = c;
+			if (cpu_fits(c))
+			{
+				best = c;
+				if (partitioning == FIRST_FIT)
+					break;
+			}
+		}
+		t->cpu = best;
+		if (best == -1)
+		{
+			printf("\n task %d (U=%lf) fits on no CPU", t->id, task_cost(t) / t->period);
+			return -1;
+		}
 	}
 
+	//report the mapping
+	printf("\n %s partitioning on %d CPUs:", partitioning == FIRST_FIT ? "first fit" : "worst fit",
+	       ncpus);
+	for (c = 0; c < ncpus; c++)
+	{
+		if (cpu_utilization(c) == 0)
+			continue;
+		printf("\n  CPU %d U=%lf tasks", c, cpu_utilization(c));
+		for (i = 0; i < ntasks; i++)
+			if (analysed(&tasks[i]) && tasks[i].cpu == c)
+				printf(" %d", tasks[i].id);
+	}
+	return 0;
+}
+
+
+//Whether task j is above task i for the resource protocols: it has a higher
+//priority, or under EDF a higher preemption level, that is a shorter
+//relative deadline. Background aperiodic tasks are below all the others.
+static int above(int j, int i)
+{
+	if (edf)
+	{
+		if (analysed(&tasks[j]) != analysed(&tasks[i]))
+			return analysed(&tasks[j]);
+		return task_deadline(&tasks[j]) < task_deadline(&tasks[i]) ||
+		       (task_deadline(&tasks[j]) == task_deadline(&tasks[i]) && j < i);
+	}
+	return tasks[j].priority > tasks[i].priority ||
+	       (tasks[j].priority == tasks[i].priority && j < i);
+}
 
+//longest critical section of task j on resource r, 0 if it does not use it
+static long int section(int j, int r)
+{
+	long int cs = 0;
 
-	
-	//open the driver file
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+	for (int k = 0; k < tasks[j].nuses; k++)
+		if (tasks[j].uses[k].res == r && tasks[j].uses[k].cs > cs)
+			cs = tasks[j].uses[k].cs;
+	return cs;
+}
+
+//whether resource r can block task i: its ceiling, the highest of its
+//users, is at or above i
+static int can_block(int r, int i)
+{
+	for (int j = 0; j < ntasks; j++)
+		if (section(j, r) && (j == i || above(j, i)))
+			return 1;
+	return 0;
+}
 
-         }
-         str = "2]"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+//A task is blocked by the critical sections that tasks below it hold on
+//resources whose ceiling is at or above it. With priority inheritance it
+//can be blocked once by each lower task and once on each resource:
+//  B = min(sum over lower j of the longest such section of j,
+//          sum over resources r of the longest such section on r)
+//With the priority ceiling protocol, and with the stack resource policy,
+//which under fixed priorities is the same immediate ceiling, it is blocked
+//at most once, before it starts:
+//  B = longest such section of any lower task
+//Without a protocol the inversion is unbounded; the inheritance bound is
+//used, with a warning. Lower tasks on other CPUs are counted too, so that
+//the bound holds wherever the partitioning puts them.
+void resource_blocking()
+{
+	int i, j, r, used = 0;
+
+	for (j = 0; j < ntasks; j++)
+		if (tasks[j].nuses)
+			used = 1;
+	if (!used)
+		return;
+	if (protocol == PROTO_NONE)
+		printf("\n no resource protocol: priority inversion is unbounded, B assumes inheritance");
+	for (i = 0; i < ntasks; i++)
+	{
+		double by_task = 0, by_res = 0, once = 0, longest;
+
+		if (!analysed(&tasks[i]))
+			continue;
+		for (j = 0; j < ntasks; j++)
+		{
+			if (j == i || above(j, i))
+				continue;
+			longest = 0;
+			for (r = 1; r <= MAXRES; r++)
+				if (can_block(r, i) && section(j, r) > longest)
+					longest = section(j, r);
+			by_task += longest;
+			if (longest > once)
+				once = longest;
+		}
+		for (r = 1; r <= MAXRES; r++)
+		{
+			if (!can_block(r, i))
+				continue;
+			longest = 0;
+			for (j = 0; j < ntasks; j++)
+				if (j != i && !above(j, i) && section(j, r) > longest)
+					longest = section(j, r);
+			by_res += longest;
+		}
+		tasks[i].blocking += protocol >= PROTO_PCP ? once : by_task < by_res ? by_task : by_res;
+	}
+}
 
-         }
+//Priority inheritance is PTHREAD_PRIO_INHERIT. The priority ceiling, and the
+//stack resource policy with it, is PTHREAD_PRIO_PROTECT with the highest
+//priority of the users of the resource as ceiling. A ceiling needs a real
+//time policy to raise the priority to: without privileges, the threads fall
+//back to inheritance.
+//The bounds of resource_blocking() are for tasks sharing a CPU: a resource
+//shared across CPUs also blocks remotely, for as long as a task of another
+//CPU is preempted in its critical section, which is not bounded.
+//A thread above the ceiling of a resource cannot take it: every user of a
+//resource must be at or below the ceiling the mutex ends up with.
+int init_resources()
+{
+	pthread_mutexattr_t attr;
+	int r, j, k, ceiling, cpu, err, kind = protocol;
+
+	for (r = 1; r <= MAXRES && !edf; r++)
+	{
+		cpu = -1;
+		for (j = 0; j < ntasks; j++)
+			if (section(j, r))
+			{
+				if (cpu != -1 && tasks[j].cpu != cpu)
+				{
+					printf("\n resource %d is shared across CPUs: remote blocking is not bounded", r);
+					break;
+				}
+				cpu = tasks[j].cpu;
+			}
+	}
 
-	 close(fd);
-	 
+	if (kind >= PROTO_PCP && getuid() != 0)
+	{
+		printf("\n no privileges for priority ceilings, using priority inheritance");
+		kind = PROTO_PI;
+	}
+	for (r = 1; r <= MAXRES; r++)
+	{
+		err = pthread_mutexattr_init(&attr);
+		if (err == 0 && kind == PROTO_PI)
+			err = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+		else if (err == 0 && kind >= PROTO_PCP)
+		{
+			ceiling = sched_get_priority_min(SCHED_FIFO);
+			for (j = 0; j < ntasks; j++)
+				if (section(j, r) && tasks[j].priority > ceiling)
+					ceiling = tasks[j].priority;
+			err = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_PROTECT);
+			if (err == 0)
+				err = pthread_mutexattr_setprioceiling(&attr, ceiling);
+		}
+		if (err == 0)
+			err = pthread_mutex_init(&resources[r], &attr);
+		pthread_mutexattr_destroy(&attr);
+		if (err != 0)
+		{
+			fprintf(stderr, "\n resource %d: %s\n", r, strerror(err));
+			return -1;
+		}
+		if (kind < PROTO_PCP)
+			continue;
+		pthread_mutex_getprioceiling(&resources[r], &ceiling);
+		for (j = 0; j < ntasks; j++)
+			for (k = 0; k < tasks[j].nuses; k++)
+				if (tasks[j].uses[k].res == r && tasks[j].priority > ceiling)
+				{
+					fprintf(stderr, "\n task %d: priority %d above the ceiling %d of resource %d\n",
+						tasks[j].id, tasks[j].priority, ceiling, r);
+					return -1;
+				}
+	}
+	return 0;
+}
 
-  
-  	//print the id of the current task
 
-  	
+//EDF admission: the density sum C / min(D, T) of all periodic tasks and
+//servers must not exceed 1. With deadlines equal to the periods it is the exact test U <= 1,
+//and it also holds under global EDF on any number of CPUs, since the threads
+//are not pinned. Each task then meets its deadline, which is the bound
+//reported next to the measured response time.
+//With blocking on shared resources (Baker) every task k must also pass
+//  sum over i with Di <= Dk of Ci / min(Di, Ti) + Bk / min(Dk, Tk) <= 1
+static double edf_window(const struct task *t)
+{
+	return task_deadline(t) < t->period ? task_deadline(t) : t->period;
 }
 
+int edf_schedulable()
+{
+	double U = 0, density = 0, d;
+	int ret = 0;
+
+	for (int i = 0; i < ntasks; i++)
+	{
+		if (!analysed(&tasks[i]))
+			continue;
+		U += task_cost(&tasks[i]) / tasks[i].period;
+		density += task_cost(&tasks[i]) / edf_window(&tasks[i]);
+		tasks[i].response = task_deadline(&tasks[i]);
+	}
+	printf("\n EDF: U=%lf density=%lf", U, density);
+	if (density > 1)
+		ret = -1;
+
+	for (int k = 0; k < ntasks; k++)
+	{
+		if (!analysed(&tasks[k]) || tasks[k].blocking == 0)
+			continue;
+		d = tasks[k].blocking / edf_window(&tasks[k]);
+		for (int i = 0; i < ntasks; i++)
+			if (analysed(&tasks[i]) && task_deadline(&tasks[i]) <= task_deadline(&tasks[k]))
+				d += task_cost(&tasks[i]) / edf_window(&tasks[i]);
+		printf("\n  task %d: B=%.1f us, density with blocking %lf%s", tasks[k].id,
+		       tasks[k].blocking / 1000.0, d, d > 1 ? " MISS" : "");
+		if (d > 1)
+			ret = -1;
+	}
+	return ret;
+}
 
 
-//thread code for task_2 (used only for temporization)
-void *task2( void *ptr)
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+//layout of the sched_setattr() argument; glibc has no wrapper before 2.41
+struct dl_attr {
+	unsigned int size;
+	unsigned int sched_policy;
+	unsigned long long sched_flags;
+	int sched_nice;
+	unsigned int sched_priority;
+	unsigned long long sched_runtime;	//ns
+	unsigned long long sched_deadline;
+	unsigned long long sched_period;
+};
+
+//The runtime is the WCET used by the analysis, margin included: a job that
+//runs longer is throttled until its next period, and shows up as a missed
+//deadline. For a
+//server it is the budget: the kernel then enforces it as a constant
+//bandwidth server.
+int set_deadline(struct task *t)
 {
-	// set thread affinity, that is the processor on which threads shall run
-	cpu_set_t cset;
-	CPU_ZERO (&cset);
-	CPU_SET(0, &cset);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
+	struct dl_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_runtime = (unsigned long long)ceil(task_cost(t));
+	if (attr.sched_runtime < 1024)		//the kernel refuses less than about 1 us
+		attr.sched_runtime = 1024;
+	attr.sched_deadline = task_deadline(t);
+	attr.sched_period = t->period;
+	if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1)
+	{
+		fprintf(stderr, "task %d: ", t->id);
+		perror("sched_setattr SCHED_DEADLINE failed");
+		return -1;
+	}
+	return 0;
+}
 
-   	//execute the task one hundred times... it should be an infinite loop (too dangerous)
-  	int i=0;
-  	for (i=0; i < 100; i++)
-    	{
-      		// execute application specific code
-		task2_code();
-		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next_arrival_time[0], NULL);
-		long int next_arrival_nanoseconds = next_arrival_time[0].tv_nsec + periods[0];
-		next_arrival_time[0].tv_nsec= next_arrival_nanoseconds%1000000000;
-		next_arrival_time[0].tv_sec= next_arrival_time[0].tv_sec + next_arrival_nanoseconds/1000000000;
-    	}
+//the caches are flushed by walking a buffer twice the size of the last level cache
+static void flush_caches(void)
+{
+	static volatile char *buf;
+	static long int size;
+
+	if (!buf)
+	{
+		size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+		size = size > 0 ? 2 * size : 64L << 20;
+		buf = (volatile char *)malloc(size);
+		if (!buf)
+			return;
+	}
+	for (long int k = 0; k < size; k += 64)
+		buf[k]++;
+}
+
+//Run the workload of a task wcet_runs times on its own CPU, with the priority
+//of the main thread, and take the largest time plus the safety margin as its
+//WCET. CLOCK_MONOTONIC_RAW is not slewed by NTP, so samples are comparable.
+void profile_task(struct task *t)
+{
+	double *sample = (double *)malloc(sizeof(double) * wcet_runs);
+	struct timespec time_1, time_2;
+	int r, n = wcet_runs;
+
+	if (sample == NULL)
+	{
+		perror("wcet samples");
+		exit(-1);
+	}
+	set_affinity(t->cpu);
+	if (wl_init(&workload, t->kernel, t->wss, t->id) == -1)
+	{
+		perror("workload");
+		exit(-1);
+	}
+
+	//size the workload from the time of one iteration of its kernel
+	if (t->exec)
+	{
+		double ns = wl_calibrate(&workload);
+
+		if (t->outer == 0)
+			t->outer = 1;
+		t->inner = (int)ceil(t->exec / ns / t->outer);
+		printf("\n  task %d: %s kernel, %.2f ns per iteration, %d x %d for %ld us",
+		       t->id, wl_names[t->kernel], ns, t->outer, t->inner, t->exec / 1000);
+	}
+
+	td_session_open(&session, open_channel(t->id));
+	for (r = 0; r < n; r++)
+	{
+		if (cold)
+			flush_caches();
+		clock_gettime(CLOCK_MONOTONIC_RAW, &time_1);
+		task_code(t, 0);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &time_2);
+		sample[r] = 1000000000.0*(time_2.tv_sec - time_1.tv_sec)
+			    +(time_2.tv_nsec-time_1.tv_nsec);
+	}
+	td_session_close(&session);
+	wl_free(&workload);
+
+	qsort(sample, n, sizeof(double), cmp_double);
+	t->WCET = sample[n - 1] * (1 + margin / 100);
+	printf("\nWorst Case Execution Time %d=%f \n", t->id, t->WCET);
+	if (n > 1)
+		printf("  %d %s runs, us: min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f, margin %g%%\n",
+		       n, cold ? "cold" : "warm", sample[0] / 1000, percentile(sample, n, 0.5) / 1000,
+		       percentile(sample, n, 0.99) / 1000, percentile(sample, n, 0.999) / 1000,
+		       sample[n - 1] / 1000, margin);
+	free(sample);
+}
+
+
+//set by the deadline timer of the thread when the running job must be
+//aborted, -o abort
+__thread volatile sig_atomic_t job_abort;
+
+static void deadline_expired(int sig)
+{
+	(void)sig;
+	job_abort = 1;
+}
+
+//the job me of the calling thread takes its CPU in running[]: the job
+//running there, if any, is preempted by it
+static void cpu_take(struct task *t, unsigned long me)
+{
+	int cpu = trace && !edf ? sched_getcpu() : -1;
+
+	if (cpu < 0 || cpu >= MAXCPUS)
+		return;
+	running_cpu = cpu;
+	running_me = me;
+	running_prev = __atomic_load_n(&running[cpu].job, __ATOMIC_RELAXED);
+	if (running_prev)
+		trace_event(t, running_prev >> 32, TASKDRIVER_EV_PREEMPT,
+			    (unsigned int)running_prev, t->id, 0);
+	__atomic_store_n(&running[cpu].job, me, __ATOMIC_RELAXED);
 }
 
+//the job of the calling thread leaves its CPU: the job it preempted goes
+//on, unless another one took the CPU meanwhile
+static void cpu_give_back(void)
+{
+	if (running_cpu < 0)
+		return;
+	__atomic_compare_exchange_n(&running[running_cpu].job, &running_me, running_prev, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	running_cpu = -1;
+}
+
+//take a resource; a job that has to wait for it leaves its CPU meanwhile,
+//and preempts whatever runs there when it gets the resource. Returns 0, or
+//the error of the lock, EINVAL if the thread is above the ceiling.
+static int lock_resource(struct task *t, pthread_mutex_t *m)
+{
+	unsigned long me = running_me;
+	int held = running_cpu >= 0, err;
+
+	if ((err = pthread_mutex_trylock(m)) != EBUSY)
+		return err;
+	cpu_give_back();
+	err = pthread_mutex_lock(m);
+	if (held)
+		cpu_take(t, me);
+	return err;
+}
+
+//each critical section holds its resource for its length of CPU time, spent
+//in the kernel of the task; while the WCET is measured nothing is locked.
+//A section whose lock fails is not run unprotected: it is skipped and
+//counted.
+static void critical_sections(struct task *t)
+{
+	struct timespec now;
+	long int start;
+
+	for (int k = 0; k < t->nuses; k++)
+	{
+		if (!measuring && lock_resource(t, &resources[t->uses[k].res]) != 0)
+		{
+			counter_add(&t->counters.lock_errors, 1);
+			continue;
+		}
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+		start = timespec_ns(&now);
+		do
+		{
+			wl_run(&workload, 16);
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+		}
+		while (timespec_ns(&now) - start < t->uses[k].cs);
+		if (!measuring)
+			pthread_mutex_unlock(&resources[t->uses[k].res]);
+	}
+}
 
-void task3_code()
+// application specific code, the same for every task
+int task_code(struct task *t, int job)
 {
+	//record the start of the job in the trace session of the thread
+	td_session_record(&session, t->id, TASKDRIVER_EV_START, job);
+	cpu_take(t, (unsigned long)t->id << 32 | (unsigned int)job);
+	trace_event(t, t->id, TASKDRIVER_EV_START, job, 0, 0);
+
+	//the kernel of the task wastes the time, in outer chunks of inner
+	//iterations; an aborted job stops at the end of a chunk. Half way
+	//through, the job enters its critical sections.
+	int i;
+  	for (i = 0; i < t->outer && !job_abort; i++)
+	{
+		if (i == t->outer / 2)
+			critical_sections(t);
+		wl_run(&workload, t->inner);
+	}
 
+  	// one job in ten, drawn from the generator of the thread, executes
+  	// the aperiodic task; an aborted job activates nothing
+  	if (t->activates && wl_rand(&workload) % 10 == 0 && !measuring && i == t->outer)
+		activate(t->activates, t->id, job);
+
+	//the job is over: record its end and hand both events to the driver
+	trace_event(t, t->id, TASKDRIVER_EV_END, job, 0, 0);
+	cpu_give_back();
+	td_session_record(&session, t->id, TASKDRIVER_EV_END, job);
+	td_session_flush(&session);
+	return i == t->outer;
+}
 
 
-	int fd, result, len;
-        const char *str;	
-	
-	//open the driver file
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
-         }
-         str = "[3"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+#define DEADLINE_SIGNAL (SIGRTMIN + 1)
 
-         }
+//thread code of periodic tasks (used only for temporization)
+void *periodic_task( void *ptr )
+{
+	struct task *t = (struct task *)ptr;
+	struct timespec now;
+	struct itimerspec its;
+	struct sigaction sa;
+	struct sigevent sev;
+	struct rusage ru;
+	timer_t deadline_timer;
+	long int late, release, next, k;
+	int err;
+
+	//SCHED_DEADLINE threads cannot be pinned, they run under global EDF
+	if (edf)
+		set_deadline(t);
+	else
+		set_affinity(t->cpu);
+	if (lock_memory)
+		prefault_stack();
+	if (td_session_open(&session, open_channel(t->id)) == -1)
+		perror("open failed");
+	if (wl_init(&workload, t->kernel, t->wss, t->id) == -1)
+	{
+		perror("workload");
+		return NULL;
+	}
 
-	 close(fd);
-	 
+	//to abort a job at its deadline, a timer of the thread goes off at the
+	//absolute deadline and the workload stops at the next outer iteration
+	if (overrun == ABORT)
+	{
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = deadline_expired;
+		sigaction(DEADLINE_SIGNAL, &sa, NULL);
+
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = DEADLINE_SIGNAL;
+		sev.sigev_notify_thread_id = syscall(SYS_gettid);
+		if (timer_create(CLOCK_MONOTONIC, &sev, &deadline_timer) == -1)
+		{
+			perror("deadline timer");
+			return NULL;
+		}
+	}
 
-	
+	//glibc allocates the priority ceiling state of a thread when it first
+	//takes a PTHREAD_PRIO_PROTECT mutex: take each resource once now
+	for (k = 0; k < t->nuses; k++)
+	{
+		if ((err = pthread_mutex_lock(&resources[t->uses[k].res])) != 0)
+		{
+			fprintf(stderr, "task %d: resource %d: %s\n", t->id,
+				t->uses[k].res, strerror(err));
+			continue;
+		}
+		pthread_mutex_unlock(&resources[t->uses[k].res]);
+	}
 
+	//from here on the thread should take no page fault and allocate nothing
+	getrusage(RUSAGE_THREAD, &ru);
+	counter_add(&t->counters.minflt, -ru.ru_minflt);
+	counter_add(&t->counters.majflt, -ru.ru_majflt);
+	hot_task = t;
 
-	int i,j;
-	double uno;
-  	for (i = 0; i < OUTERLOOP*50; i++)
+   	//execute the task NJOBS times... it should be an infinite loop (too dangerous)
+  	for (int i=0; i < NJOBS; i++)
     	{
-      		for (j = 0; j < INNERLOOP*20; j++);		
-			double uno = rand()*rand()%10;
-    	}
-    	
-    	
+		// the job was released one period before the next arrival
+		next = timespec_ns(&t->next_arrival_time);
+		release = next - t->period;
+		trace_event(t, t->id, TASKDRIVER_EV_RELEASE, i + 1, 0, release);
+
+		if (overrun == ABORT)
+		{
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = (release + t->deadline) / 1000000000;
+			its.it_value.tv_nsec = (release + t->deadline) % 1000000000;
+			timer_settime(deadline_timer, TIMER_ABSTIME, &its, NULL);
+		}
+
+      		// execute application specific code
+		job_started(t, release);
+		if (!task_code(t, i + 1))
+			counter_add(&t->counters.aborted, 1);
 
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (overrun == ABORT)
+		{
+			memset(&its, 0, sizeof(its));
+			timer_settime(deadline_timer, 0, &its, NULL);
+			job_abort = 0;
+		}
+		job_done(t, timespec_ns(&now), release);
 
-	
-	//open the driver file
-	if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+		//the job ran past the next release: with -o skip the releases that
+		//are already over are dropped, otherwise they are run late, one
+		//after the other, until the task catches up
+		if (overrun == SKIP && timespec_ns(&now) >= next)
+		{
+			k = (timespec_ns(&now) - next) / t->period + 1;
+			counter_add(&t->counters.skipped, k);
+			next += k * t->period;
+			t->next_arrival_time.tv_sec = next / 1000000000;
+			t->next_arrival_time.tv_nsec = next % 1000000000;
+		}
 
-         }
-         str = "3]"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t->next_arrival_time, NULL);
 
-         }
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = timespec_ns(&now) - timespec_ns(&t->next_arrival_time);
+		if (late < 0)
+			late = 0;
+		counter_add(&t->counters.delay_sum, late);
+		counter_max(&t->counters.delay_max, late);
+		hdr_record(&t->hist[HIST_RELEASE], late);
 
-	 close(fd);
-	 
+		long int next_arrival_nanoseconds = t->next_arrival_time.tv_nsec + t->period;
+		t->next_arrival_time.tv_nsec= next_arrival_nanoseconds%1000000000;
+		t->next_arrival_time.tv_sec= t->next_arrival_time.tv_sec + next_arrival_nanoseconds/1000000000;
+    	}
+	hot_task = NULL;
+	getrusage(RUSAGE_THREAD, &ru);
+	counter_add(&t->counters.minflt, ru.ru_minflt);
+	counter_add(&t->counters.majflt, ru.ru_majflt);
+
+	if (overrun == ABORT)
+		timer_delete(deadline_timer);
+	td_session_close(&session);
+	wl_free(&workload);
+	return NULL;
 }
 
-void *task3( void *ptr)
+
+//account a served activation: response time from the moment it was posted
+static void activation_done(struct task *t, const struct actq_record *act)
 {
-	// set thread affinity, that is the processor on which threads shall run
-	cpu_set_t cset;
-	CPU_ZERO (&cset);
-	CPU_SET(0, &cset);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
+	struct timespec now;
 
-	int i=0;
-  	for (i=0; i < 100; i++)
-    	{
-      		task3_code();
+	// the queue stamps activations with CLOCK_MONOTONIC as well
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	job_done(t, timespec_ns(&now), act->post_ns);
+}
+
+
+//one line every report seconds with the jobs run and the deadlines missed
+//by each task so far; the counters are only read, the tasks never wait for
+//the reporter
+void *reporter(void *)
+{
+	struct timespec start, now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1)
+	{
+		sleep(report);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		printf("\n[%4ld s]", now.tv_sec - start.tv_sec);
+		for (i = 0; i < ntasks; i++)
+		{
+			struct task_counters *c = &tasks[i].counters;
 
-		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next_arrival_time[2], NULL);
-		long int next_arrival_nanoseconds = next_arrival_time[2].tv_nsec + periods[2];
-		next_arrival_time[2].tv_nsec= next_arrival_nanoseconds%1000000000;
-		next_arrival_time[2].tv_sec= next_arrival_time[2].tv_sec + next_arrival_nanoseconds/1000000000;
-    }
+			printf("  %d: %ld/%ld", tasks[i].id, counter_read(&c->jobs),
+			       counter_read(&c->missed));
+			if (counter_read(&c->missed))
+				printf(" late %.1f us", counter_read(&c->lateness_max) / 1000.0);
+		}
+		fflush(stdout);
+	}
+	return NULL;
 }
 
 
+void *dumper(void *)
+{
+	sigset_t usr1;
+	int sig;
+
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	while (sigwait(&usr1, &sig) == 0)
+		dump_histograms();
+	return NULL;
+}
 
+static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+#define NPERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
 
-void task4_code()
+//the histograms are copied before they are read, the tasks go on
+//recording meanwhile; the lock only keeps the dumper and main apart
+void dump_histograms()
 {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static struct hdr snap;
+	FILE *f = NULL;
+	int json = 0, first = 1, i, h, b;
+	unsigned int p;
+
+	pthread_mutex_lock(&lock);
+	if (hist_file)
+	{
+		size_t len = strlen(hist_file);
+
+		json = len > 5 && strcmp(hist_file + len - 5, ".json") == 0;
+		if ((f = fopen(hist_file, "w")) == NULL)
+			perror(hist_file);
+		else if (json)
+			fprintf(f, "{\"tasks\": [");
+		else
+			fprintf(f, "task,metric,low_ns,high_ns,count\n");
+	}
+
+	printf("\nLatencies us        count");
+	for (p = 0; p < NPERCENTILES; p++)
+		printf("  p%-7g", percentiles[p]);
+	printf("  max\n");
+	for (i = 0; i < ntasks; i++)
+	{
+		if (f && json)
+			fprintf(f, "%s\n  {\"id\": %d, \"type\": \"%c\"", i ? "," : "",
+				tasks[i].id, tasks[i].type);
+		for (h = 0; h < NHIST; h++)
+		{
+			hdr_snapshot(&snap, &tasks[i].hist[h]);
+			if (snap.total == 0)
+				continue;
+
+			printf("task %3d %-8s %8lu", tasks[i].id, hist_names[h],
+			       (unsigned long)snap.total);
+			for (p = 0; p < NPERCENTILES; p++)
+				printf("  %8.1f", hdr_percentile(&snap, percentiles[p]) / 1000.0);
+			printf("  %.1f\n", snap.max / 1000.0);
+			if (f == NULL)
+				continue;
+
+			if (json)
+			{
+				fprintf(f, ",\n   \"%s\": {\"count\": %lu, \"max_ns\": %lu, \"percentiles_ns\": {",
+					hist_names[h], (unsigned long)snap.total, (unsigned long)snap.max);
+				for (p = 0; p < NPERCENTILES; p++)
+					fprintf(f, "%s\"%g\": %lu", p ? ", " : "", percentiles[p],
+						(unsigned long)hdr_percentile(&snap, percentiles[p]));
+				fprintf(f, "},\n    \"buckets\": [");
+			}
+			first = 1;
+			for (b = 0; b < HDR_BUCKETS; b++)
+			{
+				if (snap.count[b] == 0)
+					continue;
+				unsigned long low = hdr_low(b);
+				unsigned long high = b == HDR_BUCKETS - 1 ? snap.max : hdr_high(b);
+				if (json)
+					fprintf(f, "%s[%lu, %lu, %lu]", first ? "" : ", ",
+						low, high, (unsigned long)snap.count[b]);
+				else
+					fprintf(f, "%d,%s,%lu,%lu,%lu\n", tasks[i].id, hist_names[h],
+						low, high, (unsigned long)snap.count[b]);
+				first = 0;
+			}
+			if (json)
+				fprintf(f, "]}");
+		}
+		if (f && json)
+			fprintf(f, "}");
+	}
+	if (f)
+	{
+		if (json)
+			fprintf(f, "\n]}\n");
+		fclose(f);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&lock);
+}
 
-	int fd, result, len;
-        const char *str;	
-	
-	//open the driver file
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
 
-         }
-         str = "[4"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+//Aperiodic servers in user space. The server thread runs at the rate
+//monotonic priority of its replenishment period and takes the activations
+//posted to its actq.h queue, in order, while it has budget: a deferrable or
+//sporadic server sleeps on the queue, a polling server only looks at it at
+//its releases. The budget is
+//enforced with a timer on the CPU time of the thread: when it runs out in
+//the middle of a request the thread drops to the background priority and
+//finishes the request there, so the periodic tasks never see more than the
+//budget per period. The priority is restored when the request is over.
+//
+//polling     the budget is refilled at every period; if no request is
+//            pending at that moment the budget is lost until the next one
+//deferrable  the budget is refilled at every period and kept while the
+//            server waits for requests
+//sporadic    each chunk of budget used is given back one period after the
+//            server started to use it
+
+__thread int server_background;		//priority the server drops to
+__thread volatile sig_atomic_t server_demoted;
+
+static void budget_exhausted(int sig)
+{
+	struct sched_param param;
 
-         }
+	(void)sig;
+	param.sched_priority = server_background;
+	sched_setparam(0, &param);
+	server_demoted = 1;
+}
 
-	 close(fd);
-	 
-	
+//CPU time of the calling thread, in ns
+static long int thread_cputime(void)
+{
+	struct timespec now;
 
-	//waste sometime
-	for (int i = 0; i < OUTERLOOP; i++)
-    	{
-      		for (int j = 0; j < INNERLOOP; j++)
-			double uno = rand()*rand();
-    	}
-    	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return timespec_ns(&now);
+}
 
+//sleep until an absolute CLOCK_MONOTONIC time in ns
+static void sleep_until(long int when)
+{
+	struct timespec t;
 
-	
-	//open the driver file
-	 if ((fd = open ("/dev/taskdriver", O_RDWR)) == -1) {
-                  perror("open failed");
+	t.tv_sec = when / 1000000000;
+	t.tv_nsec = when % 1000000000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
 
-         }
-         str = "4]"; 
-	 len = strlen(str)+1;
-	 //write the id of the current task
-         if ((result = write (fd, str, len)) != len) 
-	 {
-                  perror("write failed");
+static long int now_ns(void)
+{
+	struct timespec now;
 
-         }
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_ns(&now);
+}
 
-	 close(fd);
-	 
+//serve one request with at most left ns of budget at the server priority;
+//returns the CPU time it used
+static long int serve_request(struct task *t, timer_t budget_timer, long int left,
+			      const struct actq_record *act)
+{
+	struct itimerspec its;
+	struct sched_param param;
+	long int start = thread_cputime();
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = left / 1000000000;
+	its.it_value.tv_nsec = left % 1000000000;
+	timer_settime(budget_timer, 0, &its, NULL);
+
+	job_started(t, act->post_ns);
+	task_code(t, act->seq);
+
+	memset(&its, 0, sizeof(its));
+	timer_settime(budget_timer, 0, &its, NULL);
+	if (server_demoted)
+	{
+		param.sched_priority = t->priority;
+		sched_setparam(0, &param);
+		server_demoted = 0;
+	}
+	activation_done(t, act);
+	return thread_cputime() - start;
 }
 
-void *task4( void *)
+#define MAXREPL 32	//pending replenishments of a sporadic server
+
+void serve(struct task *t)
 {
-	// set thread affinity, that is the processor on which threads shall run
-	cpu_set_t cset;
-	CPU_ZERO (&cset);
-	CPU_SET(0, &cset);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
+	struct actq_record act;
+	struct sigaction sa;
+	struct sigevent sev;
+	timer_t budget_timer;
+	clockid_t cpu_clock;
+	long int left = t->budget, next, now;
+	struct { long int when, amount; } repl[MAXREPL];
+	int nrepl = 0, k;
+
+	server_background = sched_get_priority_min(SCHED_FIFO);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = budget_exhausted;
+	sigaction(SIGRTMIN, &sa, NULL);
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGRTMIN;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	pthread_getcpuclockid(pthread_self(), &cpu_clock);
+	if (timer_create(cpu_clock, &sev, &budget_timer) == -1)
+	{
+		perror("budget timer");
+		return;
+	}
 
-	//add an infinite loop 
+	next = timespec_ns(&t->next_arrival_time);
 	while (1)
-    	{
-		// wait for the proper condition to be signalled
-		// See below why mutexes have been commented
-		pthread_mutex_lock(&mutex_task_4);
-		pthread_cond_wait(&cond_task_4, &mutex_task_4);
-		pthread_mutex_unlock(&mutex_task_4);
-		// execute the task code
- 		task4_code();
+	{
+		if (t->server == POLLING)
+		{
+			//at each release, serve what is pending until the budget is over
+			sleep_until(next);
+			next += t->period;
+			for (left = t->budget; left > 0; left -= serve_request(t, budget_timer, left, &act))
+			{
+				if (actq_pop(t->queue, &act, 1) == 0)
+					break;		//nothing pending: the budget is lost
+				activations_taken(t, &act, 1);
+			}
+			continue;
+		}
+
+		actq_wait(t->queue, &act, 1);
+		activations_taken(t, &act, 1);
+
+		now = now_ns();
+		if (t->server == DEFERRABLE)
+		{
+			//full budget again at every period boundary
+			if (now >= next)
+			{
+				next += ((now - next) / t->period + 1) * t->period;
+				left = t->budget;
+			}
+			if (left <= 0)
+			{
+				sleep_until(next);
+				next += t->period;
+				left = t->budget;
+			}
+			left -= serve_request(t, budget_timer, left, &act);
+			continue;
+		}
+
+		//sporadic: take back the chunks whose replenishment time has come,
+		//waiting for the first one if the budget is over
+		for (;;)
+		{
+			for (k = 0; k < nrepl; )
+				if (repl[k].when <= now)
+				{
+					left += repl[k].amount;
+					repl[k] = repl[--nrepl];
+				}
+				else
+					k++;
+			if (left > 0 || nrepl == 0)
+				break;
+			next = repl[0].when;
+			for (k = 1; k < nrepl; k++)
+				if (repl[k].when < next)
+					next = repl[k].when;
+			sleep_until(next);
+			now = now_ns();
+		}
+		if (left > t->budget)
+			left = t->budget;
+		long int used = serve_request(t, budget_timer, left, &act);
+		left -= used;
+		if (nrepl == MAXREPL)
+		{
+			//too many chunks: merge two, returning both at the later time
+			repl[0].amount += repl[--nrepl].amount;
+			repl[0].when = now + t->period;
+			repl[0].amount += used;
+		}
+		else
+		{
+			repl[nrepl].when = now + t->period;
+			repl[nrepl].amount = used;
+			nrepl++;
+		}
 	}
+	timer_delete(budget_timer);
 }
 
 
+//thread code of aperiodic tasks
+void *aperiodic_task( void *ptr )
+{
+	struct task *t = (struct task *)ptr;
+	struct actq_record act[ACT_BATCH];
+	int i, n;
+
+	//under EDF a server is a SCHED_DEADLINE reservation, whose budget the
+	//kernel enforces; otherwise the thread is pinned to its CPU
+	if (t->server && edf)
+		set_deadline(t);
+	else
+		set_affinity(t->cpu);
+	if (lock_memory)
+		prefault_stack();
+
+	if (td_session_open(&session, open_channel(t->id)) == -1)
+		perror("open failed");
+	if (wl_init(&workload, t->kernel, t->wss, t->id) == -1)
+	{
+		perror("workload");
+		return NULL;
+	}
 
+	if (t->server && !edf)
+	{
+		serve(t);
+		td_session_close(&session);
+		return NULL;
+	}
 
-
+	//add an infinite loop
+	while (1)
+    	{
+		// wait for the next activations; the pending ones are kept in the
+		// queue and taken in a batch, each of them runs the task once
+		n = actq_wait(t->queue, act, ACT_BATCH);
+		activations_taken(t, act, n);
+		for (i = 0; i < n; i++)
+		{
+			// execute the task code
+			job_started(t, act[i].post_ns);
+ 			task_code(t, act[i].seq);
+			activation_done(t, &act[i]);
+		}
+	}
+	td_session_close(&session);
+	return NULL;
+}
@@ -0,0 +1,165 @@
+/*
+* actq.h -- lock-free queue of activations between threads of a process
+*
+* A bounded ring of activation records with any number of producers and a
+* single consumer. A producer claims a slot with one compare-and-swap on
+* the tail and publishes the record with one store to the sequence number
+* of the slot; it never blocks and never takes a lock, whatever the
+* priority of the consumer. When the ring is full the record is dropped
+* and counted.
+*
+* The consumer sleeps on a futex only when the ring is empty, and only then
+* does a producer make a system call, to wake it. Records are taken in the
+* order their slots were claimed, one at a time or in batches.
+*/
+
+#ifndef _ACTQ_H_
+#define _ACTQ_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define ACTQ_SLOTS	256	/* power of two */
+
+struct actq_record {
+	uint64_t post_ns;	/* CLOCK_MONOTONIC time of the push */
+	uint32_t seq;		/* activation number, from 1 */
+	uint16_t source;	/* task that posted it */
+	uint16_t pad;
+	uint64_t payload;	/* passed through as given */
+};
+
+struct actq_slot {
+	uint32_t seq;		/* pos + 1 when full for pos, pos + ACTQ_SLOTS
+				   when free again */
+	uint32_t pad;
+	struct actq_record rec;
+};
+
+struct actq {
+	uint32_t tail;		/* next slot to claim, producers */
+	uint32_t dropped;	/* records lost because the ring was full */
+	uint32_t pad0[14];
+	uint32_t head;		/* next slot to take, consumer only */
+	uint32_t pad1[15];
+	uint32_t wakeups;	/* futex word, bumped to wake the consumer */
+	uint32_t sleeping;	/* the consumer is about to sleep, or sleeps */
+	uint32_t pad2[14];
+	struct actq_slot slots[ACTQ_SLOTS];
+};
+
+/*
+* Allocate an empty queue, or NULL.
+*/
+static inline struct actq *actq_create(void)
+{
+	struct actq *q;
+	uint32_t i;
+
+	if (posix_memalign((void **)&q, 64, sizeof(*q)) != 0)
+		return NULL;
+	memset(q, 0, sizeof(*q));
+	for (i = 0; i < ACTQ_SLOTS; i++)
+		q->slots[i].seq = i;
+	return q;
+}
+
+static inline void actq_wake(struct actq *q)
+{
+	/* pairs with the fence of actq_wait(): either the consumer sees the
+	   record, or we see it sleeping */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&q->wakeups, 1, __ATOMIC_RELAXED);
+		syscall(SYS_futex, &q->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+/*
+* Post an activation; seq and post_ns are filled in. Returns the activation
+* number, or 0 if the ring was full and the record was dropped.
+*/
+static inline uint32_t actq_push(struct actq *q, uint16_t source, uint64_t payload)
+{
+	struct actq_slot *s;
+	struct timespec now;
+	uint32_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	int32_t dif;
+
+	for (;;) {
+		s = &q->slots[pos & (ACTQ_SLOTS - 1)];
+		dif = (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			__atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->rec.post_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	s->rec.seq = pos + 1;
+	s->rec.source = source;
+	s->rec.pad = 0;
+	s->rec.payload = payload;
+
+	/* publish the record before the consumer can see the slot full */
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	actq_wake(q);
+	return pos + 1;
+}
+
+/*
+* Take up to max records without blocking. Returns how many were taken.
+* Only the consumer thread may call it.
+*/
+static inline int actq_pop(struct actq *q, struct actq_record *rec, int max)
+{
+	struct actq_slot *s;
+	uint32_t pos = q->head;
+	int n;
+
+	for (n = 0; n < max; n++, pos++) {
+		s = &q->slots[pos & (ACTQ_SLOTS - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			break;
+		rec[n] = s->rec;
+		/* hand the slot back to the producers, one lap later */
+		__atomic_store_n(&s->seq, pos + ACTQ_SLOTS, __ATOMIC_RELEASE);
+	}
+	q->head = pos;
+	return n;
+}
+
+/*
+* Take up to max records, sleeping until there is at least one. Returns
+* how many were taken. Only the consumer thread may call it.
+*/
+static inline int actq_wait(struct actq *q, struct actq_record *rec, int max)
+{
+	uint32_t w;
+	int n;
+
+	while ((n = actq_pop(q, rec, max)) == 0) {
+		w = __atomic_load_n(&q->wakeups, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((n = actq_pop(q, rec, max)) == 0)
+			syscall(SYS_futex, &q->wakeups, FUTEX_WAIT_PRIVATE, w, NULL, NULL, 0);
+		__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+		if (n)
+			break;
+	}
+	return n;
+}
+
+#endif /* _ACTQ_H_ */
@@ -0,0 +1,131 @@
+/*
+* hdr.h -- log-linear latency histograms, HdrHistogram style
+*
+* Values below HDR_SUB are counted exactly; each power of two above is split
+* into HDR_SUB buckets of equal width, so a value is known within 1/HDR_SUB
+* of itself (about 3%) anywhere in the range. Values from 2^HDR_MAX_BITS up
+* go to the last bucket. A histogram is allocated once and recording is a
+* few instructions with no allocation, no lock and no system call.
+*
+* A histogram has a single writer. It updates the counts with relaxed atomic
+* stores, so another thread can take a consistent enough snapshot of it
+* while it is being written, without slowing the writer down.
+*/
+
+#ifndef _HDR_H_
+#define _HDR_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HDR_SUB_BITS	5
+#define HDR_SUB		(1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS	40	/* ns: about 18 minutes */
+#define HDR_BUCKETS	(HDR_SUB + (HDR_MAX_BITS - HDR_SUB_BITS) * HDR_SUB)
+
+struct hdr {
+	uint64_t total;		/* values recorded */
+	uint64_t max;		/* largest value recorded, exact */
+	uint64_t count[HDR_BUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+* Allocate n empty histograms, or NULL.
+*/
+static inline struct hdr *hdr_create(int n)
+{
+	struct hdr *h;
+
+	if (posix_memalign((void **)&h, 64, n * sizeof(*h)) != 0)
+		return NULL;
+	memset(h, 0, n * sizeof(*h));
+	return h;
+}
+
+static inline int hdr_index(uint64_t v)
+{
+	int m;
+
+	if (v < HDR_SUB)
+		return (int)v;
+	if (v >> HDR_MAX_BITS)
+		return HDR_BUCKETS - 1;
+	m = 63 - __builtin_clzll(v);
+	return HDR_SUB + (m - HDR_SUB_BITS) * HDR_SUB +
+	       (int)(v >> (m - HDR_SUB_BITS)) - HDR_SUB;
+}
+
+/* smallest value of bucket i */
+static inline uint64_t hdr_low(int i)
+{
+	int m;
+
+	if (i < HDR_SUB)
+		return i;
+	m = (i - HDR_SUB) / HDR_SUB + HDR_SUB_BITS;
+	return (uint64_t)(HDR_SUB + (i - HDR_SUB) % HDR_SUB) << (m - HDR_SUB_BITS);
+}
+
+/* largest value of bucket i */
+static inline uint64_t hdr_high(int i)
+{
+	return i == HDR_BUCKETS - 1 ? UINT64_MAX : hdr_low(i + 1) - 1;
+}
+
+/*
+* Record a value; only the writer of the histogram may call it.
+*/
+static inline void hdr_record(struct hdr *h, int64_t v)
+{
+	uint64_t *c;
+
+	if (v < 0)
+		v = 0;
+	c = &h->count[hdr_index(v)];
+	__atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+	if ((uint64_t)v > h->max)
+		__atomic_store_n(&h->max, (uint64_t)v, __ATOMIC_RELAXED);
+}
+
+/*
+* Copy a histogram that may be being written. The total is recomputed from
+* the counts copied, so that the percentiles of the copy add up.
+*/
+static inline void hdr_snapshot(struct hdr *to, const struct hdr *from)
+{
+	int i;
+
+	to->total = 0;
+	for (i = 0; i < HDR_BUCKETS; i++) {
+		to->count[i] = __atomic_load_n(&from->count[i], __ATOMIC_RELAXED);
+		to->total += to->count[i];
+	}
+	to->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+}
+
+/*
+* Value below which p percent of the values fall: the top of the bucket
+* reached, but never more than the largest value. 0 if the histogram is empty.
+*/
+static inline uint64_t hdr_percentile(const struct hdr *h, double p)
+{
+	uint64_t rank, seen = 0, high;
+	int i;
+
+	if (h->total == 0)
+		return 0;
+	rank = (uint64_t)(p / 100 * h->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HDR_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			break;
+	}
+	high = hdr_high(i < HDR_BUCKETS ? i : HDR_BUCKETS - 1);
+	return high < h->max ? high : h->max;
+}
+
+#endif /* _HDR_H_ */
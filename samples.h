@@ -0,0 +1,34 @@
+/*
+* samples.h -- summary of a set of timing samples
+*
+* Shared by the WCET profiler of Tasks.c and the benchmarks of taskbench:
+* the samples are sorted with qsort() and cmp_double(), then read with
+* percentile().
+*/
+
+#ifndef _SAMPLES_H_
+#define _SAMPLES_H_
+
+static inline int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+* Nearest rank percentile p (0 .. 1) of n sorted samples: the smallest one
+* with at least p * n samples at or below it.
+*/
+static inline double percentile(const double *sorted, int n, double p)
+{
+	int r = (int)(p * n);
+
+	if (r < p * n)
+		r++;
+	if (r < 1)
+		r = 1;
+	return sorted[(r < n ? r : n) - 1];
+}
+
+#endif /* _SAMPLES_H_ */
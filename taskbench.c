@@ -0,0 +1,520 @@
+//compile with: gcc -O2 taskbench.c -o taskbench -lpthread
+
+//Micro-benchmark of the ways a task can submit trace events to the taskdriver.
+//Each mode submits the same number of start/end event pairs and reports the
+//average cost per event, so the modes can be compared on the same machine.
+//
+//With -c N it runs a contention test instead: N threads pinned to different
+//CPUs write markers concurrently while a reader drains the device, and the
+//latency of every write is reported together with the lock hold times the
+//driver measured. The writes use the plain text markers, so the same test
+//runs against older versions of the driver for a before/after comparison.
+//
+//With -r PERIOD_US it measures release jitter instead: n releases of a
+//periodic task are timed once with the clock_nanosleep() loop Tasks.c uses
+//and once with the driver timer (TASKDRIVER_IOC_WAIT_RELEASE), and the
+//distribution of the wake up delay after each nominal release is printed.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "taskdriver.h"
+#include "tdsession.h"
+#include "samples.h"
+
+#define DEFAULT_DEVICE	"/dev/taskdriver0"
+#define DEFAULT_EVENTS	100000
+#define DEFAULT_BATCH	64
+
+const char *device = DEFAULT_DEVICE;
+int nevents = DEFAULT_EVENTS;
+int batchsize = DEFAULT_BATCH;
+int nthreads = 0;
+int period_us = 0;
+
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int open_device(int flags)
+{
+	int fd = open(device, O_RDWR | flags);
+
+	if (fd == -1) {
+		perror("open failed");
+		exit(1);
+	}
+	return fd;
+}
+
+//drain what the previous mode left, so every mode starts with empty rings
+static void drain(void)
+{
+	struct taskdriver_event ev[256];
+	int rfd = open_device(O_NONBLOCK);
+
+	while (read(rfd, ev, sizeof(ev)) > 0)
+		;
+	close(rfd);
+}
+
+
+//Events are submitted in rounds small enough to fit the driver rings and the
+//rings are drained between rounds, outside the timed part, so no mode is
+//measured while the driver is dropping events.
+#define ROUND	256
+
+int fd = -1;
+struct taskdriver_mmap_ring *ring;
+size_t ringsize = 64 * 1024;
+
+static void open_fd(void)
+{
+	fd = open_device(0);
+}
+
+static void close_fd(void)
+{
+	close(fd);
+}
+
+//what Tasks.c does: open, write a text marker, close
+static void bench_open_write_close(int first, int n)
+{
+	char str[16];
+	int i, len;
+
+	for (i = first; i < first + n; i++) {
+		len = sprintf(str, i % 2 ? "%d]" : "[%d", 1) + 1;
+		fd = open_device(0);
+		if (write(fd, str, len) != len)
+			perror("write failed");
+		close(fd);
+	}
+}
+
+//one open, then a write per text marker
+static void bench_write(int first, int n)
+{
+	char str[16];
+	int i, len;
+
+	for (i = first; i < first + n; i++) {
+		len = sprintf(str, i % 2 ? "%d]" : "[%d", 1) + 1;
+		if (write(fd, str, len) != len)
+			perror("write failed");
+	}
+}
+
+//one binary record per ioctl
+static void bench_ioctl(int first, int n)
+{
+	struct taskdriver_event ev;
+	int i;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.task = 1;
+	for (i = first; i < first + n; i++) {
+		ev.type = i % 2 ? TASKDRIVER_EV_END : TASKDRIVER_EV_START;
+		ev.job = i / 2;
+		if (ioctl(fd, TASKDRIVER_IOC_EVENT, &ev) == -1)
+			perror("ioctl failed");
+	}
+}
+
+//batchsize binary records per ioctl
+static void bench_batch(int first, int n)
+{
+	struct taskdriver_event ev[TASKDRIVER_MAX_BATCH];
+	struct taskdriver_batch batch;
+	int i, j, k;
+
+	memset(ev, 0, sizeof(ev));
+	batch.events = (__u64)(unsigned long)ev;
+	batch.pad = 0;
+
+	for (i = first; i < first + n; i += k) {
+		k = first + n - i < batchsize ? first + n - i : batchsize;
+		for (j = 0; j < k; j++) {
+			ev[j].task = 1;
+			ev[j].type = (i + j) % 2 ? TASKDRIVER_EV_END : TASKDRIVER_EV_START;
+			ev[j].job = (i + j) / 2;
+		}
+		batch.count = k;
+		if (ioctl(fd, TASKDRIVER_IOC_BATCH, &batch) != k)
+			perror("batch ioctl failed");
+	}
+}
+
+//what Tasks.c does now: a session opened once, events stamped into a
+//buffer and flushed at the end of every job, that is every two events
+struct td_session session;
+
+static void open_session(void)
+{
+	td_session_open(&session, open_device(0));
+}
+
+static void close_session(void)
+{
+	if (session.dropped)
+		printf("   (%lu session events dropped)\n", session.dropped);
+	td_session_close(&session);
+}
+
+static void bench_session(int first, int n)
+{
+	int i;
+
+	for (i = first; i < first + n; i++) {
+		td_session_record(&session, 1,
+				  i % 2 ? TASKDRIVER_EV_END : TASKDRIVER_EV_START, i / 2);
+		if (i % 2)
+			td_session_flush(&session);
+	}
+	td_session_flush(&session);
+}
+
+//plain stores into a ring mapped from the driver
+static void map_ring(void)
+{
+	open_fd();
+	ring = (struct taskdriver_mmap_ring *)mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+						   MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap failed");
+		exit(1);
+	}
+}
+
+static void unmap_ring(void)
+{
+	if (ring->dropped)
+		printf("   (mmap ring full, %u events dropped)\n", ring->dropped);
+	munmap(ring, ringsize);
+	close_fd();
+}
+
+static void bench_mmap(int first, int n)
+{
+	int i;
+
+	for (i = first; i < first + n; i++)
+		taskdriver_mmap_record(ring, 1,
+				       i % 2 ? TASKDRIVER_EV_END : TASKDRIVER_EV_START, i / 2);
+}
+
+
+struct mode {
+	const char *name;
+	void (*setup)(void);
+	void (*run)(int first, int n);
+	void (*teardown)(void);
+};
+
+struct mode modes[] = {
+	{ "open/write/close", NULL,     bench_open_write_close, NULL },
+	{ "write",            open_fd,  bench_write,            close_fd },
+	{ "ioctl event",      open_fd,  bench_ioctl,            close_fd },
+	{ "ioctl batch",      open_fd,  bench_batch,            close_fd },
+	{ "session per job",  open_session, bench_session,      close_session },
+	{ "mmap store",       map_ring, bench_mmap,             unmap_ring },
+};
+
+
+//contention test
+
+volatile int stop_reader;
+
+struct writer {
+	pthread_t tid;
+	int cpu;
+	int n;
+	double *lat;	//latency of each write in ns
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = (struct writer *)arg;
+	char str[16];
+	int i, len, wfd;
+	double t0;
+	cpu_set_t cset;
+
+	CPU_ZERO(&cset);
+	CPU_SET(w->cpu, &cset);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cset);
+
+	wfd = open_device(0);
+	for (i = 0; i < w->n; i++) {
+		len = sprintf(str, i % 2 ? "%d]" : "[%d", w->cpu + 1) + 1;
+		t0 = now_ns();
+		if (write(wfd, str, len) != len)
+			perror("write failed");
+		w->lat[i] = now_ns() - t0;
+	}
+	close(wfd);
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct taskdriver_event ev[256];
+	int rfd = open_device(O_NONBLOCK);
+
+	(void)arg;
+	while (!stop_reader)
+		if (read(rfd, ev, sizeof(ev)) <= 0)
+			usleep(1000);
+	close(rfd);
+	return NULL;
+}
+
+//turn on the hold time accounting of the driver, if it has any
+static void set_lockstat(int on)
+{
+	FILE *f = fopen("/sys/module/taskdriver/parameters/lockstat", "w");
+
+	if (f) {
+		fputs(on ? "1" : "0", f);
+		fclose(f);
+	}
+}
+
+static int get_stats(struct taskdriver_stats *st)
+{
+	int sfd = open_device(O_NONBLOCK);
+	int ret = ioctl(sfd, TASKDRIVER_IOC_GET_STATS, st);
+
+	close(sfd);
+	return ret;
+}
+
+static void contention(void)
+{
+	struct writer *w;
+	struct taskdriver_stats before, after;
+	pthread_t reader;
+	double *all;
+	int i, j, k, per_thread = nevents / nthreads, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int have_stats;
+
+	w = (struct writer *)calloc(nthreads, sizeof(*w));
+	all = (double *)malloc(sizeof(double) * per_thread * nthreads);
+
+	set_lockstat(1);
+	have_stats = get_stats(&before) == 0;
+
+	stop_reader = 0;
+	pthread_create(&reader, NULL, reader_thread, NULL);
+	for (i = 0; i < nthreads; i++) {
+		w[i].cpu = i % ncpus;
+		w[i].n = per_thread;
+		w[i].lat = all + i * per_thread;
+		pthread_create(&w[i].tid, NULL, writer_thread, &w[i]);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].tid, NULL);
+	stop_reader = 1;
+	pthread_join(reader, NULL);
+
+	if (have_stats)
+		have_stats = get_stats(&after) == 0;
+	set_lockstat(0);
+
+	k = per_thread * nthreads;
+	qsort(all, k, sizeof(double), cmp_double);
+	double sum = 0;
+	for (j = 0; j < k; j++)
+		sum += all[j];
+
+	printf("%d writer threads, %d writes each\n", nthreads, per_thread);
+	printf("write latency ns: avg %.0f  p50 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+	       sum / k, percentile(all, k, 0.5), percentile(all, k, 0.99),
+	       percentile(all, k, 0.999), all[k - 1]);
+
+	if (have_stats) {
+		unsigned long long appends = after.appends - before.appends;
+		unsigned long long reads = after.reads - before.reads;
+
+		printf("driver append hold ns: avg %.0f  max %llu  (%llu sections)\n",
+		       appends ? (double)(after.append_hold_ns - before.append_hold_ns) / appends : 0.0,
+		       (unsigned long long)after.append_hold_max_ns, appends);
+		printf("driver read hold ns:   avg %.0f  max %llu  (%llu sections)\n",
+		       reads ? (double)(after.read_hold_ns - before.read_hold_ns) / reads : 0.0,
+		       (unsigned long long)after.read_hold_max_ns, reads);
+		printf("events dropped: %llu\n",
+		       (unsigned long long)(after.dropped - before.dropped));
+	} else {
+		printf("driver lock statistics not available\n");
+	}
+
+	free(all);
+	free(w);
+}
+
+
+//release jitter test
+
+static void print_jitter(const char *name, double *lat, int k, int late)
+{
+	double sum = 0;
+	int j;
+
+	qsort(lat, k, sizeof(double), cmp_double);
+	for (j = 0; j < k; j++)
+		sum += lat[j];
+	printf("%-18s avg %.0f  p50 %.0f  p99 %.0f  max %.0f  overruns %d\n",
+	       name, sum / k, percentile(lat, k, 0.5), percentile(lat, k, 0.99), lat[k - 1], late);
+}
+
+//the Tasks.c loop: add the period to the previous release and sleep until it
+static void jitter_user(double *lat, int k)
+{
+	struct timespec next, now;
+	int i, late = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < k; i++) {
+		next.tv_nsec += period_us * 1000L;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		lat[i] = (now.tv_sec - next.tv_sec) * 1e9 + (now.tv_nsec - next.tv_nsec);
+		if (lat[i] >= period_us * 1000.0)
+			late++;
+	}
+	print_jitter("clock_nanosleep", lat, k, late);
+}
+
+//the driver timer releases the task, the ioctl returns each release
+static void jitter_driver(double *lat, int k)
+{
+	struct taskdriver_period per;
+	struct taskdriver_release rel;
+	int i, late = 0;
+
+	memset(&per, 0, sizeof(per));
+	per.period_ns = period_us * 1000ULL;
+	per.task = 1;
+	fd = open_device(0);
+	if (ioctl(fd, TASKDRIVER_IOC_SET_PERIOD, &per) == -1) {
+		perror("period ioctl failed");
+		close(fd);
+		return;
+	}
+	for (i = 0; i < k; i++) {
+		if (ioctl(fd, TASKDRIVER_IOC_WAIT_RELEASE, &rel) == -1) {
+			perror("release ioctl failed");
+			break;
+		}
+		lat[i] = (double)(rel.wakeup_ns - rel.release_ns);
+		if (rel.pending)
+			late++;
+	}
+	close(fd);
+	if (i == k)
+		print_jitter("driver hrtimer", lat, k, late);
+}
+
+static void jitter(void)
+{
+	double *lat = (double *)malloc(sizeof(double) * nevents);
+
+	printf("%d releases, period %d us, wake up delay after the release in ns\n",
+	       nevents, period_us);
+	jitter_user(lat, nevents);
+	jitter_driver(lat, nevents);
+	drain();
+	free(lat);
+}
+
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-n events] [-b batchsize] [-c threads]"
+		" [-r period_us]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:b:c:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			nevents = atoi(optarg);
+			break;
+		case 'b':
+			batchsize = atoi(optarg);
+			break;
+		case 'c':
+			//every writer needs at least one event
+			if ((nthreads = atoi(optarg)) < 1)
+				usage(argv[0]);
+			break;
+		case 'r':
+			period_us = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nevents <= 0 || batchsize <= 0 || batchsize > TASKDRIVER_MAX_BATCH ||
+	    nthreads > nevents || period_us < 0)
+		usage(argv[0]);
+
+	if (period_us) {
+		jitter();
+		return 0;
+	}
+
+	if (nthreads) {
+		contention();
+		return 0;
+	}
+
+	printf("%d events per mode, batch size %d\n", nevents, batchsize);
+	for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		double t0, elapsed = 0;
+		int i, n;
+
+		if (modes[m].setup)
+			modes[m].setup();
+		for (i = 0; i < nevents; i += n) {
+			n = nevents - i < ROUND ? nevents - i : ROUND;
+			drain();
+			t0 = now_ns();
+			modes[m].run(i, n);
+			elapsed += now_ns() - t0;
+		}
+		if (modes[m].teardown)
+			modes[m].teardown();
+		printf("%-18s %10.1f ns/event\n", modes[m].name, elapsed / nevents);
+	}
+	drain();
+	return 0;
+}
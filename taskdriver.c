@@ -17,10 +17,27 @@
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
-#include <linux/semaphore.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/rculist.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/device.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
 
 //#include <asm/system.h>         /* cli(), *_flags */
 #include <asm/uaccess.h>        /* copy_*_user */
+
+#include "taskdriver.h"
  
  
 /*
@@ -30,135 +47,1380 @@
  
 int taskdriver_major =   0;
 int taskdriver_minor =   0;
-int memsize	= 255;
+int memsize	= 16384;	/* bytes of ring buffer per CPU */
+int mmap_poll_ms = 10;	/* how often mapped rings are checked for readers */
+int ndevices	= 1;	/* number of channels, /dev/taskdriver0 .. N-1 */
+bool lockstat;		/* account the time spent in critical sections */
+int logmode	= 1;	/* 0 no kernel log, 1 batched by a work, 2 per event */
+int log_ms	= 100;	/* delay of the batched log after the first event */
 
 module_param(taskdriver_major, int, S_IRUGO);
 module_param(taskdriver_minor, int, S_IRUGO);
 module_param(memsize, int, S_IRUGO);
+module_param(mmap_poll_ms, int, S_IRUGO);
+module_param(ndevices, int, S_IRUGO);
+module_param(lockstat, bool, S_IRUGO | S_IWUSR);
+module_param(logmode, int, S_IRUGO | S_IWUSR);
+module_param(log_ms, int, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Mahmoud Elasmar-forked from -Antonio Sgorbissa");
 MODULE_LICENSE("Dual BSD/GPL");
 
+enum { TASKDRIVER_LOG_OFF, TASKDRIVER_LOG_BATCHED, TASKDRIVER_LOG_EVENT };
+
+
+/*
+* Every event is appended to a ring owned by the CPU it runs on, so writers
+* on different cores never touch the same cache lines and never sleep.
+* Each ring has a single producer (its CPU, with interrupts disabled since
+* the release timers append from interrupt context) and a single consumer
+* (the reader, serialized by dev->lock), so head and tail are published
+* with acquire/release ordering and need no lock. What the producer writes
+* and what the reader and the log work write are on separate cache lines,
+* so draining a ring from another CPU does not steal the line the next
+* append writes.
+*
+* A file that is mmap()ed gets a further ring shared with user space (see
+* taskdriver.h); the reader merges those together with the per-CPU rings.
+* Stores into a mapped ring make no system call, so a delayed work checks
+* those rings every mmap_poll_ms and wakes up the sleeping readers.
+*
+* The kernel log is written off the hot path: with logmode=1 a delayed work
+* prints the events appended since its last run, following each ring with
+* its own log_tail, which writers respect like the reader tail.
+*
+* The list of mapped files is updated under dev->lock and walked under RCU
+* by everything that only looks (poll, the watch work, statistics), and the
+* counters kept by the reader are published through dev->stats_seq, so
+* nothing but another reader ever waits for a reader.
+*/
+struct taskdriver_ring {
+	struct taskdriver_event *slots;
+	unsigned int mask;	/* number of slots - 1 */
+	unsigned int head;	/* next slot to fill, written by the owning CPU */
+	unsigned long events;	/* events appended */
+	unsigned long dropped;	/* events lost because the ring was full */
+	unsigned long appends;	/* non-preemptible sections, with lockstat */
+	u64 hold_ns;		/* time spent in them */
+	u64 hold_max_ns;
+
+	/* next slot to read, written by the reader */
+	unsigned int tail ____cacheline_aligned_in_smp;
+	unsigned int log_tail;	/* next slot to log, written by the log work */
+};
+
+/*
+* Live statistics of one task, updated in O(1) as its events arrive: a
+* start is paired with the next end of the same task to get the execution
+* time, and consecutive starts give the inter-release times. Writers take
+* the seqlock, /proc readers only retry.
+*/
+#define TASKDRIVER_HIST_BUCKETS	24	/* log2 buckets of microseconds */
+
+struct taskdriver_task_stats {
+	u64 jobs;		/* start/end pairs */
+	u64 unpaired;		/* ends without a start, starts without an end */
+	u64 start;		/* ts of the job in progress, 0 if none */
+	u64 prev_start;		/* ts of the previous start */
+	u64 exec_min, exec_max, exec_sum;
+	u64 releases;		/* inter-release intervals measured */
+	u64 period_min, period_max, period_sum;
+	u32 hist[TASKDRIVER_HIST_BUCKETS];	/* execution times */
+	u64 kreleases;		/* releases by a driver timer */
+	u64 overruns;		/* ... that found the previous one still pending */
+	u64 waits;		/* releases returned by TASKDRIVER_IOC_WAIT_RELEASE */
+	u64 wake_min, wake_max, wake_sum; /* release to wake up latency */
+	u64 activations;	/* posted by TASKDRIVER_IOC_ACTIVATE */
+	u64 act_pending_max;	/* most activations pending at once */
+	u64 activated;		/* post time of the activation taken, 0 if none */
+	u64 act_starts;		/* activations followed by a start */
+	u64 act_min, act_max, act_sum; /* activation to start latency */
+};
+
+/*
+* Aperiodic activations of a task: a counter of posted and taken
+* activations, so none is lost however late the task waits, and the post
+* times of the last TASKDRIVER_ACT_DEPTH ones for the latency statistics.
+*/
+#define TASKDRIVER_ACT_DEPTH	16
+
+struct taskdriver_act_stamp {
+	u64 ns;
+	u32 seq;		/* activation number the time belongs to */
+};
 
+struct taskdriver_task {
+	seqlock_t lock;
+	struct taskdriver_task_stats s;
+
+	spinlock_t act_lock;
+	wait_queue_head_t actq;
+	u32 posted, taken;
+	struct taskdriver_act_stamp stamp[TASKDRIVER_ACT_DEPTH];
+};
+
+/*
+* One channel. Every minor has its own rings, locks and statistics, so
+* tasks tracing to different channels share nothing in the driver.
+*/
 struct taskdriver_dev {
-         char *data;  /* Pointer to data area */
-	 int memsize;
-         struct semaphore sem;     /* mutual exclusion semaphore    */
-         struct cdev cdev;         /* structure for char devices */
+	int index;		  /* minor offset, /dev/taskdriver<index> */
+	struct taskdriver_ring __percpu *rings; /* one ring per CPU */
+	unsigned int nslots;	  /* slots in each ring, a power of two */
+	struct mutex lock;        /* serializes readers and updates of mapped */
+	struct list_head mapped;  /* RCU list of files with a ring mapped */
+	struct delayed_work watch; /* polls the mapped rings */
+	struct delayed_work logwork; /* batched kernel log */
+	unsigned long log_armed;  /* bit 0: logwork is scheduled */
+	wait_queue_head_t readq;  /* readers waiting for events */
+	atomic_t jobs[TASKDRIVER_MAX_TASKS]; /* job numbers for text markers */
+	struct taskdriver_task *tasks; /* TASKDRIVER_MAX_TASKS statistics */
+	seqlock_t stats_seq;	  /* publishes the reader counters below */
+	u64 mapped_events;	  /* events drained from mapped rings */
+	u64 read_events;	  /* events returned by read() */
+	u64 reads;		  /* reader critical sections, with lockstat */
+	u64 read_hold_ns;	  /* time spent in them */
+	u64 read_hold_max_ns;
+	struct cdev cdev;         /* structure for char devices */
 };
  
-struct taskdriver_dev taskdriver_device; 
+struct taskdriver_dev *taskdriver_devices;	/* allocated in init_module */
+int taskdriver_nready;		/* channels fully set up */
+struct class *taskdriver_class;
+static struct proc_dir_entry *taskdriver_proc;	/* NULL until created */
+
+/* per open file state */
+struct taskdriver_file {
+	struct taskdriver_dev *dev;
+	struct taskdriver_mmap_ring *ring; /* shared ring, NULL until mmap() */
+	unsigned int mask;	/* kernel copies, the shared header is not trusted */
+	unsigned int tail;
+	struct list_head list;	/* on dev->mapped */
+	struct taskdriver_event carry;	/* record a short read left half way */
+	unsigned int carry_off;	/* bytes of carry already read */
+
+	/* periodic release, see TASKDRIVER_IOC_SET_PERIOD */
+	struct hrtimer timer;
+	wait_queue_head_t relq;	/* the task waiting for its next release */
+	u64 period;		/* ns, 0 if not periodic */
+	u64 first;		/* CLOCK_MONOTONIC ns of release 1 */
+	u32 released;		/* releases fired by the timer */
+	u32 taken;		/* releases returned to the task */
+	u16 task;
+};
+
+/* where the oldest pending event found by the reader lives */
+struct taskdriver_src {
+	struct taskdriver_ring *ring;
+	struct taskdriver_file *tf;
+};
+
+
+/*
+* Update the statistics of the task an event belongs to.
+*/
+static void taskdriver_account(struct taskdriver_dev *dev,
+			       const struct taskdriver_event *ev, u64 ts)
+{
+	struct taskdriver_task_stats *t;
+	unsigned long flags;
+	u64 d;
+	int b;
+
+	if (ev->task >= TASKDRIVER_MAX_TASKS)
+		return;
+	t = &dev->tasks[ev->task].s;
+
+	write_seqlock_irqsave(&dev->tasks[ev->task].lock, flags);
+	switch (ev->type) {
+	case TASKDRIVER_EV_START:
+		if (t->start)
+			t->unpaired++;
+		if (t->activated && ts > t->activated) {
+			d = ts - t->activated;
+			if (!t->act_starts || d < t->act_min)
+				t->act_min = d;
+			if (d > t->act_max)
+				t->act_max = d;
+			t->act_sum += d;
+			t->act_starts++;
+		}
+		t->activated = 0;
+		if (t->prev_start && ts > t->prev_start) {
+			d = ts - t->prev_start;
+			if (!t->releases || d < t->period_min)
+				t->period_min = d;
+			if (d > t->period_max)
+				t->period_max = d;
+			t->period_sum += d;
+			t->releases++;
+		}
+		t->start = t->prev_start = ts;
+		break;
+	case TASKDRIVER_EV_RELEASE:
+		t->kreleases++;
+		if (ev->arg)
+			t->overruns++;
+		break;
+	case TASKDRIVER_EV_ACTIVATE:
+		t->activations++;
+		if (ev->arg > t->act_pending_max)
+			t->act_pending_max = ev->arg;
+		break;
+	case TASKDRIVER_EV_END:
+		if (!t->start || ts < t->start) {
+			t->unpaired++;
+			break;
+		}
+		d = ts - t->start;
+		t->start = 0;
+		if (!t->jobs || d < t->exec_min)
+			t->exec_min = d;
+		if (d > t->exec_max)
+			t->exec_max = d;
+		t->exec_sum += d;
+		t->jobs++;
+		b = fls64(div_u64(d, NSEC_PER_USEC));
+		t->hist[min(b, TASKDRIVER_HIST_BUCKETS - 1)]++;
+		break;
+	}
+	write_sequnlock_irqrestore(&dev->tasks[ev->task].lock, flags);
+}
+
+
+/*
+* Append n events to the ring of the current CPU in one section with
+* interrupts disabled. Events with ts 0 are stamped here with the time and the CPU.
+* If the ring fills up the remaining events are dropped and counted: a
+* tracing write must never wait for the reader.
+*/
+static void taskdriver_append(struct taskdriver_dev *dev,
+			      const struct taskdriver_event *ev, unsigned int n)
+{
+	struct taskdriver_ring *ring;
+	struct taskdriver_event *e;
+	unsigned int head, used, room, i, n_all = n;
+	unsigned long flags;
+	u64 now;
+	int cpu;
+
+	local_irq_save(flags);
+	ring = this_cpu_ptr(dev->rings);
+	cpu = smp_processor_id();
+	now = ktime_get_ns();
+
+	head = ring->head;
+	used = head - smp_load_acquire(&ring->tail);
+	if (logmode == TASKDRIVER_LOG_BATCHED) {
+		/* do not overwrite what the log work has not printed yet */
+		unsigned int logged = head - smp_load_acquire(&ring->log_tail);
+
+		if (logged > used && logged <= ring->mask + 1)
+			used = logged;
+	}
+	room = ring->mask + 1 - used;
+	if (n > room) {
+		ring->dropped += n - room;
+		n = room;
+	}
+	ring->events += n;
+
+	for (i = 0; i < n; i++) {
+		e = &ring->slots[(head + i) & ring->mask];
+		*e = ev[i];
+		if (!e->ts) {
+			e->ts = now;
+			e->cpu = cpu;
+		}
+	}
+
+	/* publish the events before the reader can see the new head */
+	smp_store_release(&ring->head, head + n);
+
+	if (lockstat) {
+		u64 hold = ktime_get_ns() - now;
+
+		ring->appends++;
+		ring->hold_ns += hold;
+		if (hold > ring->hold_max_ns)
+			ring->hold_max_ns = hold;
+	}
+	local_irq_restore(flags);
+
+	/* statistics do not depend on room in the ring */
+	for (i = 0; i < n_all; i++)
+		taskdriver_account(dev, &ev[i], ev[i].ts ? ev[i].ts : now);
+
+	if (wq_has_sleeper(&dev->readq))
+		wake_up_interruptible(&dev->readq);
+
+	/* the flag is read-mostly, so writers only share a clean cache line */
+	if (logmode == TASKDRIVER_LOG_BATCHED && !READ_ONCE(dev->log_armed) &&
+	    !test_and_set_bit(0, &dev->log_armed))
+		schedule_delayed_work(&dev->logwork, msecs_to_jiffies(max(log_ms, 1)));
+}
+
+
+/*
+* Copy out the oldest event of a ring mapped in user space. Returns 0 if
+* the ring is empty. User space owns head, so it is sanity checked and the
+* ring is resynchronized if it was corrupted. Called with dev->lock held.
+*/
+static int taskdriver_peek_mapped(struct taskdriver_file *tf,
+				  struct taskdriver_event *e)
+{
+	unsigned int head = smp_load_acquire(&tf->ring->head);
+
+	if (head == tf->tail)
+		return 0;
+	if (head - tf->tail > tf->mask + 1) {
+		tf->tail = head;
+		WRITE_ONCE(tf->ring->tail, head);
+		return 0;
+	}
+
+	memcpy(e, &tf->ring->slots[tf->tail & tf->mask], sizeof(*e));
+	e->flags |= TASKDRIVER_EVF_USER_TS;
+	return 1;
+}
+
+
+/*
+* Find the oldest unread event over the per-CPU rings and the mapped rings,
+* copy it to *e and remember its source. Returns 0 if everything is empty.
+* Called with dev->lock held, which keeps the mapped files alive.
+*/
+static int taskdriver_oldest(struct taskdriver_dev *dev,
+			     struct taskdriver_event *e,
+			     struct taskdriver_src *src)
+{
+	struct taskdriver_event tmp;
+	struct taskdriver_ring *ring;
+	struct taskdriver_file *tf;
+	int cpu, found = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct taskdriver_event *head;
+
+		ring = per_cpu_ptr(dev->rings, cpu);
+		if (ring->tail == smp_load_acquire(&ring->head))
+			continue;
+		head = &ring->slots[ring->tail & ring->mask];
+		if (!found || head->ts < e->ts) {
+			*e = *head;
+			src->ring = ring;
+			src->tf = NULL;
+			found = 1;
+		}
+	}
+
+	list_for_each_entry_rcu(tf, &dev->mapped, list,
+				lockdep_is_held(&dev->lock)) {
+		if (!taskdriver_peek_mapped(tf, &tmp))
+			continue;
+		if (!found || tmp.ts < e->ts) {
+			*e = tmp;
+			src->ring = NULL;
+			src->tf = tf;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+static void taskdriver_consume(struct taskdriver_src *src)
+{
+	if (src->tf) {
+		src->tf->tail++;
+		smp_store_release(&src->tf->ring->tail, src->tf->tail);
+	} else {
+		smp_store_release(&src->ring->tail, src->ring->tail + 1);
+	}
+}
+
+
+/*
+* Release timer of a periodic file: count the release, record it in the
+* channel and wake up the task. If the task has not taken the previous
+* release yet this one is an overrun, reported in the event arg.
+*/
+static enum hrtimer_restart taskdriver_release_timer(struct hrtimer *timer)
+{
+	struct taskdriver_file *tf = container_of(timer, struct taskdriver_file,
+						  timer);
+	struct taskdriver_event ev = { 0 };
+	u64 missed;
+
+	/* releases the timer itself was too late for are still releases */
+	missed = hrtimer_forward_now(timer, ns_to_ktime(tf->period));
 
+	ev.task = tf->task;
+	ev.type = TASKDRIVER_EV_RELEASE;
+	ev.job = tf->released + 1;
+	ev.arg = tf->released - READ_ONCE(tf->taken);
+	smp_store_release(&tf->released, tf->released + (u32)missed);
+
+	taskdriver_append(tf->dev, &ev, 1);
+	wake_up_interruptible(&tf->relq);
+	return HRTIMER_RESTART;
+}
 
 
 int taskdriver_open(struct inode *inode, struct file *filp)
 {
          struct taskdriver_dev *dev; 	/* a pointer to a taskdriver_dev structire */
+         struct taskdriver_file *tf;
  
          dev = container_of(inode->i_cdev, struct taskdriver_dev, cdev);
-         filp->private_data = dev; /* stored here to be re-used in other system call*/
+
+         tf = kzalloc(sizeof(*tf), GFP_KERNEL);
+         if (!tf)
+                 return -ENOMEM;
+         tf->dev = dev;
+         INIT_LIST_HEAD(&tf->list);
+         tf->carry_off = sizeof(tf->carry);
+         init_waitqueue_head(&tf->relq);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+         hrtimer_setup(&tf->timer, taskdriver_release_timer, CLOCK_MONOTONIC,
+                       HRTIMER_MODE_ABS);
+#else
+         hrtimer_init(&tf->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+         tf->timer.function = taskdriver_release_timer;
+#endif
+         filp->private_data = tf; /* stored here to be re-used in other system call*/
  
-         return 0;           
+         /* the events are a stream: f_pos counts bytes read, no seeking */
+         return nonseekable_open(inode, filp);
 }
 
 
 int taskdriver_release(struct inode *inode, struct file *filp)
 {
+         struct taskdriver_file *tf = filp->private_data;
+         struct taskdriver_dev *dev = tf->dev;
+         struct taskdriver_event e;
+
+         hrtimer_cancel(&tf->timer);
+
+         if (tf->ring) {
+                 mutex_lock(&dev->lock);
+                 list_del_rcu(&tf->list);
+
+                 /*
+                 * The mapping is gone (it held a reference on the file), so
+                 * move what the reader has not drained yet to a per-CPU ring.
+                 */
+                 while (taskdriver_peek_mapped(tf, &e)) {
+                         taskdriver_append(dev, &e, 1);
+                         tf->tail++;
+                 }
+                 mutex_unlock(&dev->lock);
+
+                 /* lockless walkers of dev->mapped may still look at it */
+                 synchronize_rcu();
+                 vfree(tf->ring);
+         }
+         kfree(tf);
          return 0;
 }
 
 
+/*
+* Whether any mapped ring has events, walking the list under RCU.
+*/
+static bool taskdriver_mapped_pending(struct taskdriver_dev *dev)
+{
+	struct taskdriver_file *tf;
+	bool pending = false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tf, &dev->mapped, list) {
+		if (smp_load_acquire(&tf->ring->head) != READ_ONCE(tf->tail)) {
+			pending = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return pending;
+}
+
+/*
+* Whether a reader would find something, without taking any lock.
+*/
+static bool taskdriver_pending(struct taskdriver_file *tf)
+{
+	struct taskdriver_dev *dev = tf->dev;
+	struct taskdriver_ring *ring;
+	int cpu;
+
+	if (tf->carry_off < sizeof(tf->carry))
+		return true;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(dev->rings, cpu);
+		if (READ_ONCE(ring->tail) != smp_load_acquire(&ring->head))
+			return true;
+	}
+	return taskdriver_mapped_pending(dev);
+}
+
+
+/*
+* Copy up to count bytes of the merged stream to user space. A record
+* that does not fit is kept in tf->carry and finished by the next read,
+* so the stream can be read with any buffer size. Called with dev->lock
+* held; returns the bytes copied or -EFAULT and counts the events taken
+* in *nread, of which *nmapped came from mapped rings.
+*/
+static ssize_t taskdriver_copy_events(struct taskdriver_file *tf,
+				      char __user *buf, size_t count,
+				      u64 *nread, u64 *nmapped)
+{
+	struct taskdriver_dev *dev = tf->dev;
+	struct taskdriver_event e;
+	struct taskdriver_src src;
+	size_t done = 0, n;
+
+	if (tf->carry_off < sizeof(tf->carry)) {
+		n = min(count, sizeof(tf->carry) - tf->carry_off);
+		if (copy_to_user(buf, (char *)&tf->carry + tf->carry_off, n))
+			return -EFAULT;
+		tf->carry_off += n;
+		done = n;
+	}
+
+	/* merge all the rings oldest first */
+	while (done < count && taskdriver_oldest(dev, &e, &src)) {
+		n = min(count - done, sizeof(e));
+		if (copy_to_user(buf + done, &e, n))
+			return done ? done : -EFAULT;
+		taskdriver_consume(&src);
+		(*nread)++;
+		if (src.tf) {
+			/* events stored by user space are accounted when drained */
+			taskdriver_account(dev, &e, e.ts);
+			(*nmapped)++;
+		}
+		if (n < sizeof(e)) {
+			tf->carry = e;
+			tf->carry_off = n;
+		}
+		done += n;
+	}
+	return done;
+}
+
+
+/*
+* Publish the counters of one reader critical section, hold is 0 unless
+* lockstat is set.
+*/
+static void taskdriver_account_read(struct taskdriver_dev *dev, u64 nread,
+				    u64 nmapped, u64 hold)
+{
+	write_seqlock(&dev->stats_seq);
+	dev->read_events += nread;
+	dev->mapped_events += nmapped;
+	if (lockstat) {
+		dev->reads++;
+		dev->read_hold_ns += hold;
+		if (hold > dev->read_hold_max_ns)
+			dev->read_hold_max_ns = hold;
+	}
+	write_sequnlock(&dev->stats_seq);
+}
+
+
+/*
+* Drain the event stream. Blocks until at least one byte is available
+* unless the file was opened with O_NONBLOCK.
+*/
 ssize_t taskdriver_read(struct file *filp, char __user *buf, size_t count,
                  loff_t *f_pos)
 {
-         struct taskdriver_dev *dev = filp->private_data; 
+         struct taskdriver_file *tf = filp->private_data;
+         struct taskdriver_dev *dev = tf->dev; 
+         ssize_t retval;
+         u64 t0 = 0, nread, nmapped;
 
-         ssize_t retval = 0;
+         if (!count)
+                 return 0;
 
-         if (down_interruptible(&dev->sem))
-                 return -ERESTARTSYS;
-         if (count >= dev->memsize) 
-                 goto out;
-	    
+         for (;;) {
+                 if (mutex_lock_interruptible(&dev->lock))
+                         return -ERESTARTSYS;
+                 if (lockstat)
+                         t0 = ktime_get_ns();
+                 nread = nmapped = 0;
+                 retval = taskdriver_copy_events(tf, buf, count, &nread, &nmapped);
+                 taskdriver_account_read(dev, nread, nmapped,
+                                         lockstat ? ktime_get_ns() - t0 : 0);
+                 mutex_unlock(&dev->lock);
 
-         if (copy_to_user(buf, dev->data, count)) {
-                 retval = -EFAULT;
-                 goto out;
+                 if (retval)
+                         break;
+                 if (filp->f_flags & O_NONBLOCK)
+                         return -EAGAIN;
+                 if (wait_event_interruptible(dev->readq, taskdriver_pending(tf)))
+                         return -ERESTARTSYS;
          }
-         retval = count;
 
-	 out:
-	        up(&dev->sem);
-		return retval;
+         if (retval > 0)
+                 *f_pos += retval;
+         return retval;
+}
+
+
+__poll_t taskdriver_poll(struct file *filp, poll_table *wait)
+{
+	struct taskdriver_file *tf = filp->private_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;	/* writes never block */
+
+	poll_wait(filp, &tf->dev->readq, wait);
+	if (taskdriver_pending(tf))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
+
+/*
+* Look for events in the mapped rings, which user space fills without a
+* system call, and wake up the readers. Runs while any ring is mapped.
+*/
+static void taskdriver_watch(struct work_struct *work)
+{
+	struct taskdriver_dev *dev = container_of(to_delayed_work(work),
+						  struct taskdriver_dev, watch);
+
+	if (wq_has_sleeper(&dev->readq) && taskdriver_mapped_pending(dev))
+		wake_up_interruptible(&dev->readq);
+	if (!list_empty_careful(&dev->mapped))
+		schedule_delayed_work(&dev->watch, msecs_to_jiffies(max(mmap_poll_ms, 1)));
+}
+
+
+/*
+* Format an event in the same "[n" / "n]" form the tasks used to write.
+*/
+static int taskdriver_format(char *buf, size_t size,
+			     const struct taskdriver_event *ev)
+{
+	switch (ev->type) {
+	case TASKDRIVER_EV_START:
+		return scnprintf(buf, size, "[%u", ev->task);
+	case TASKDRIVER_EV_END:
+		return scnprintf(buf, size, "%u]", ev->task);
+	default:
+		return scnprintf(buf, size, "%u:%u", ev->type, ev->task);
+	}
+}
+
+/*
+* Per event logging (logmode=2), in the context of the writer.
+*/
+static void taskdriver_log(const struct taskdriver_event *ev, unsigned int n)
+{
+	char buf[32];
+	unsigned int i;
+
+	if (logmode != TASKDRIVER_LOG_EVENT)
+		return;
+	for (i = 0; i < n; i++) {
+		taskdriver_format(buf, sizeof(buf), &ev[i]);
+		printk(KERN_INFO "%s", buf);
+	}
+}
+
+/*
+* Print the events of one ring appended since the last run, many per line.
+*/
+static void taskdriver_log_ring(struct taskdriver_dev *dev,
+				struct taskdriver_ring *ring, int cpu)
+{
+	unsigned int head = smp_load_acquire(&ring->head);
+	unsigned int t = ring->log_tail;
+	char line[256];
+	int len = 0;
+
+	/* logging was off for a while, start from the present */
+	if (head - t > ring->mask + 1)
+		t = head;
+
+	for (; t != head; t++) {
+		line[len++] = ' ';
+		len += taskdriver_format(line + len, sizeof(line) - len,
+					 &ring->slots[t & ring->mask]);
+		if (len > sizeof(line) - 32) {
+			printk(KERN_INFO "taskdriver%d cpu%d:%s\n", dev->index, cpu, line);
+			len = 0;
+		}
+	}
+	if (len)
+		printk(KERN_INFO "taskdriver%d cpu%d:%.*s\n", dev->index, cpu, len, line);
+
+	smp_store_release(&ring->log_tail, t);
+}
+
+/*
+* Batched logging (logmode=1): scheduled by the first event appended after
+* the previous run, it drains all the per-CPU rings of the channel.
+*/
+static void taskdriver_logwork(struct work_struct *work)
+{
+	struct taskdriver_dev *dev = container_of(to_delayed_work(work),
+						  struct taskdriver_dev, logwork);
+	int cpu;
+
+	/* events appended from now on schedule another run */
+	clear_bit(0, &dev->log_armed);
+	smp_mb__after_atomic();
+
+	for_each_possible_cpu(cpu)
+		taskdriver_log_ring(dev, per_cpu_ptr(dev->rings, cpu), cpu);
+}
+
+
+/*
+* Parse a text marker: "[n" starts a job of task n, "n]" ends it.
+* A trailing NUL or newline is accepted.
+*/
+static int taskdriver_parse_marker(const char *s, size_t len,
+				   struct taskdriver_event *ev)
+{
+	unsigned int i = 0, digits = 0, task = 0;
+	int start = 0;
+
+	len = strnlen(s, len);
+	while (len && s[len - 1] == '\n')
+		len--;
+
+	if (len && s[0] == '[') {
+		start = 1;
+		i = 1;
+	}
+	for (; i < len && s[i] >= '0' && s[i] <= '9' && digits < 5; i++, digits++)
+		task = task * 10 + (s[i] - '0');
+
+	if (!digits || task >= TASKDRIVER_MAX_TASKS)
+		return -EINVAL;
+	if (start ? i != len : (i + 1 != len || s[i] != ']'))
+		return -EINVAL;
+
+	ev->task = task;
+	ev->type = start ? TASKDRIVER_EV_START : TASKDRIVER_EV_END;
+	return 0;
 }
- 
 
 
 ssize_t taskdriver_write(struct file *filp, const char __user *buf, size_t count,
                      loff_t *f_pos)
 {
-    struct taskdriver_dev *dev = filp->private_data;
-    ssize_t retval = 0; /* return value */
+    struct taskdriver_file *tf = filp->private_data;
+    struct taskdriver_dev *dev = tf->dev;
+    struct taskdriver_event ev = { 0 };
+    char data[16];
+    size_t len = min(count, sizeof(data));
+
+    /* Copy data from user space before entering the non-sleeping section */
+    if (copy_from_user(data, buf, len))
+        return -EFAULT;
+
+    if (taskdriver_parse_marker(data, len, &ev))
+        return -EINVAL;
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    /* the text markers carry no job number, count jobs per task here */
+    if (ev.type == TASKDRIVER_EV_START)
+        ev.job = atomic_inc_return(&dev->jobs[ev.task]);
+    else
+        ev.job = atomic_read(&dev->jobs[ev.task]);
 
-    if (count >= dev->memsize)
-        count = dev->memsize;
+    taskdriver_append(dev, &ev, 1);
 
-    /* Clear the data buffer */
-    memset(dev->data, 0, dev->memsize);
+    /* Log the event into the kernel log, if asked to do it here */
+    taskdriver_log(&ev, 1);
+
+    return count;
+}
 
-    /* Copy data from user space */
-    if (copy_from_user(dev->data, buf, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
 
-    /* Log the written data into the kernel log */
-    printk(KERN_INFO "%s", dev->data);
+/* keep a CLOCK_MONOTONIC stamp taken by user space, else let the driver stamp */
+static void taskdriver_stamp(struct taskdriver_event *ev)
+{
+	if (ev->flags & TASKDRIVER_EVF_USER_TS && ev->ts)
+		ev->flags = TASKDRIVER_EVF_USER_TS;
+	else
+		ev->ts = ev->flags = 0;
+}
 
-    retval = count;
+/*
+* Submit one binary record, see TASKDRIVER_IOC_EVENT.
+*/
+static long taskdriver_ioctl_event(struct taskdriver_dev *dev,
+				   struct taskdriver_event __user *uev)
+{
+	struct taskdriver_event ev;
+
+	if (copy_from_user(&ev, uev, sizeof(ev)))
+		return -EFAULT;
+	if (ev.type == 0 || ev.type >= TASKDRIVER_EV_MAX ||
+	    ev.task >= TASKDRIVER_MAX_TASKS)
+		return -EINVAL;
+
+	taskdriver_stamp(&ev);
+	taskdriver_append(dev, &ev, 1);
+	taskdriver_log(&ev, 1);
+	return 0;
+}
+
+
+/*
+* Submit an array of records, see TASKDRIVER_IOC_BATCH. The records are
+* copied in chunks and each chunk is appended in one ring update.
+*/
+#define TASKDRIVER_CHUNK	16
+
+static long taskdriver_ioctl_batch(struct taskdriver_dev *dev,
+				   struct taskdriver_batch __user *ubatch)
+{
+	struct taskdriver_event ev[TASKDRIVER_CHUNK];
+	struct taskdriver_event __user *uev;
+	struct taskdriver_batch batch;
+	unsigned int done, n, i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count > TASKDRIVER_MAX_BATCH)
+		return -E2BIG;
+	uev = u64_to_user_ptr(batch.events);
+
+	for (done = 0; done < batch.count; done += n) {
+		n = min_t(unsigned int, batch.count - done, TASKDRIVER_CHUNK);
+		if (copy_from_user(ev, uev + done, n * sizeof(*ev)))
+			return done ? done : -EFAULT;
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].type == 0 || ev[i].type >= TASKDRIVER_EV_MAX ||
+			    ev[i].task >= TASKDRIVER_MAX_TASKS)
+				return done ? done : -EINVAL;
+			taskdriver_stamp(&ev[i]);
+		}
+
+		taskdriver_append(dev, ev, n);
+		taskdriver_log(ev, n);
+	}
+	return done;
+}
+
+/*
+* Make the file periodic, see TASKDRIVER_IOC_SET_PERIOD.
+*/
+static long taskdriver_ioctl_set_period(struct taskdriver_file *tf,
+					struct taskdriver_period __user *uper)
+{
+	struct taskdriver_period per;
+
+	if (copy_from_user(&per, uper, sizeof(per)))
+		return -EFAULT;
+	if (per.task >= TASKDRIVER_MAX_TASKS ||
+	    (per.period_ns && per.period_ns < TASKDRIVER_MIN_PERIOD))
+		return -EINVAL;
+
+	hrtimer_cancel(&tf->timer);
+	tf->period = per.period_ns;
+	tf->task = per.task;
+	tf->released = tf->taken = 0;
+	if (!tf->period)
+		return 0;
+
+	tf->first = per.start_ns ? per.start_ns : ktime_get_ns() + tf->period;
+	hrtimer_start(&tf->timer, ns_to_ktime(tf->first), HRTIMER_MODE_ABS);
+	return 0;
+}
+
+/*
+* Wait for the next release of a periodic file, see
+* TASKDRIVER_IOC_WAIT_RELEASE. Releases are returned in order, none is
+* lost; rel.pending tells how many more have already happened.
+*/
+static long taskdriver_ioctl_wait_release(struct file *filp,
+					  struct taskdriver_release __user *urel)
+{
+	struct taskdriver_file *tf = filp->private_data;
+	struct taskdriver_task *t;
+	struct taskdriver_release rel;
+	unsigned long flags;
+	u64 lat;
+
+	if (!tf->period)
+		return -EINVAL;
+	if (smp_load_acquire(&tf->released) == tf->taken) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(tf->relq,
+				smp_load_acquire(&tf->released) != tf->taken))
+			return -ERESTARTSYS;
+	}
+
+	rel.wakeup_ns = ktime_get_ns();
+	rel.job = ++tf->taken;
+	rel.release_ns = tf->first + (u64)(rel.job - 1) * tf->period;
+	rel.pending = smp_load_acquire(&tf->released) - rel.job;
+
+	/* wake up latency of this release, for /proc/taskdriver */
+	lat = rel.wakeup_ns > rel.release_ns ? rel.wakeup_ns - rel.release_ns : 0;
+	t = &tf->dev->tasks[tf->task];
+	write_seqlock_irqsave(&t->lock, flags);
+	if (!t->s.waits || lat < t->s.wake_min)
+		t->s.wake_min = lat;
+	if (lat > t->s.wake_max)
+		t->s.wake_max = lat;
+	t->s.wake_sum += lat;
+	t->s.waits++;
+	write_sequnlock_irqrestore(&t->lock, flags);
+
+	if (copy_to_user(urel, &rel, sizeof(rel)))
+		return -EFAULT;
+	return 0;
+}
+
+
+/*
+* Post an aperiodic activation of a task, see TASKDRIVER_IOC_ACTIVATE.
+*/
+static long taskdriver_ioctl_activate(struct taskdriver_dev *dev,
+				      struct taskdriver_activation __user *uact)
+{
+	struct taskdriver_activation act;
+	struct taskdriver_event ev = { 0 };
+	struct taskdriver_task *t;
+	u64 now = ktime_get_ns();
+
+	if (copy_from_user(&act, uact, sizeof(act)))
+		return -EFAULT;
+	if (act.task >= TASKDRIVER_MAX_TASKS)
+		return -EINVAL;
+	t = &dev->tasks[act.task];
+
+	spin_lock(&t->act_lock);
+	t->posted++;
+	t->stamp[t->posted % TASKDRIVER_ACT_DEPTH].ns = now;
+	t->stamp[t->posted % TASKDRIVER_ACT_DEPTH].seq = t->posted;
+	ev.job = t->posted;
+	ev.arg = t->posted - t->taken;
+	spin_unlock(&t->act_lock);
+	wake_up_interruptible(&t->actq);
+
+	ev.ts = now;
+	ev.task = act.task;
+	ev.type = TASKDRIVER_EV_ACTIVATE;
+	taskdriver_append(dev, &ev, 1);
+	return 0;
+}
+
+/*
+* Take the oldest pending activation of a task, waiting for one if there
+* is none, see TASKDRIVER_IOC_WAIT_ACTIVATION.
+*/
+static long taskdriver_ioctl_wait_activation(struct file *filp,
+					     struct taskdriver_activation __user *uact)
+{
+	struct taskdriver_file *tf = filp->private_data;
+	struct taskdriver_activation act;
+	struct taskdriver_act_stamp *st;
+	struct taskdriver_task *t;
+	unsigned long flags;
+
+	if (copy_from_user(&act, uact, sizeof(act)))
+		return -EFAULT;
+	if (act.task >= TASKDRIVER_MAX_TASKS)
+		return -EINVAL;
+	t = &tf->dev->tasks[act.task];
+
+	for (;;) {
+		spin_lock(&t->act_lock);
+		if (t->posted != t->taken)
+			break;
+		spin_unlock(&t->act_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(t->actq,
+				READ_ONCE(t->posted) != READ_ONCE(t->taken)))
+			return -ERESTARTSYS;
+	}
+	act.job = ++t->taken;
+	act.pending = t->posted - t->taken;
+	st = &t->stamp[act.job % TASKDRIVER_ACT_DEPTH];
+	/* the post time is gone if more than TASKDRIVER_ACT_DEPTH piled up */
+	act.post_ns = st->seq == act.job ? st->ns : 0;
+	spin_unlock(&t->act_lock);
+	act.wakeup_ns = ktime_get_ns();
+
+	/* the next start of the task is measured against this activation */
+	write_seqlock_irqsave(&t->lock, flags);
+	t->s.activated = act.post_ns;
+	write_sequnlock_irqrestore(&t->lock, flags);
+
+	if (copy_to_user(uact, &act, sizeof(act)))
+		return -EFAULT;
+	return 0;
+}
+
+
+/*
+* Report the statistics of the channel, see TASKDRIVER_IOC_GET_STATS.
+*/
+static long taskdriver_ioctl_stats(struct taskdriver_dev *dev,
+				   struct taskdriver_stats __user *ustats)
+{
+	struct taskdriver_stats st;
+	struct taskdriver_ring *ring;
+	struct taskdriver_file *tf;
+	unsigned int seq;
+	int cpu;
 
+	memset(&st, 0, sizeof(st));
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(dev->rings, cpu);
+		st.events += READ_ONCE(ring->events);
+		st.dropped += READ_ONCE(ring->dropped);
+		st.appends += READ_ONCE(ring->appends);
+		st.append_hold_ns += READ_ONCE(ring->hold_ns);
+		st.append_hold_max_ns = max_t(u64, st.append_hold_max_ns,
+					      READ_ONCE(ring->hold_max_ns));
+	}
+
+	/* a snapshot that never waits for a reader holding dev->lock */
+	do {
+		seq = read_seqbegin(&dev->stats_seq);
+		st.mapped_events = dev->mapped_events;
+		st.read_events = dev->read_events;
+		st.reads = dev->reads;
+		st.read_hold_ns = dev->read_hold_ns;
+		st.read_hold_max_ns = dev->read_hold_max_ns;
+	} while (read_seqretry(&dev->stats_seq, seq));
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tf, &dev->mapped, list) {
+		st.mapped_dropped += READ_ONCE(tf->ring->dropped);
+		st.mapped++;
+	}
+	rcu_read_unlock();
+	st.nslots = dev->nslots;
+
+	if (copy_to_user(ustats, &st, sizeof(st)))
+		return -EFAULT;
+	return 0;
+}
+
+long taskdriver_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct taskdriver_file *tf = filp->private_data;
+
+	switch (cmd) {
+	case TASKDRIVER_IOC_EVENT:
+		return taskdriver_ioctl_event(tf->dev, (void __user *)arg);
+	case TASKDRIVER_IOC_BATCH:
+		return taskdriver_ioctl_batch(tf->dev, (void __user *)arg);
+	case TASKDRIVER_IOC_GET_STATS:
+		return taskdriver_ioctl_stats(tf->dev, (void __user *)arg);
+	case TASKDRIVER_IOC_SET_PERIOD:
+		return taskdriver_ioctl_set_period(tf, (void __user *)arg);
+	case TASKDRIVER_IOC_WAIT_RELEASE:
+		return taskdriver_ioctl_wait_release(filp, (void __user *)arg);
+	case TASKDRIVER_IOC_ACTIVATE:
+		return taskdriver_ioctl_activate(tf->dev, (void __user *)arg);
+	case TASKDRIVER_IOC_WAIT_ACTIVATION:
+		return taskdriver_ioctl_wait_activation(filp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+
+/*
+* Map a ring shared with user space, see struct taskdriver_mmap_ring.
+* One mapping per open file; user space records into it with plain stores.
+*/
+int taskdriver_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct taskdriver_file *tf = filp->private_data;
+	struct taskdriver_dev *dev = tf->dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct taskdriver_mmap_ring *ring;
+	unsigned int nslots;
+	int err;
+
+	if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (size < sizeof(*ring) + 2 * sizeof(struct taskdriver_event))
+		return -EINVAL;
+	nslots = rounddown_pow_of_two((size - sizeof(*ring)) /
+				      sizeof(struct taskdriver_event));
+
+	mutex_lock(&dev->lock);
+	if (tf->ring) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	ring = vmalloc_user(size);	/* zeroed and page aligned */
+	if (!ring) {
+		err = -ENOMEM;
+		goto out;
+	}
+	ring->magic = TASKDRIVER_MMAP_MAGIC;
+	ring->nslots = nslots;
+
+	err = remap_vmalloc_range(vma, ring, 0);
+	if (err) {
+		vfree(ring);
+		goto out;
+	}
+
+	tf->ring = ring;
+	tf->mask = nslots - 1;
+	tf->tail = 0;
+	list_add_tail_rcu(&tf->list, &dev->mapped);
+	schedule_delayed_work(&dev->watch, msecs_to_jiffies(max(mmap_poll_ms, 1)));
 out:
-    up(&dev->sem);
-    return retval;
+	mutex_unlock(&dev->lock);
+	return err;
+}
+
+
+/*
+* /proc/taskdriver: the statistics of every task that has events, for
+* all the channels. The position walks channel * TASKDRIVER_MAX_TASKS + task.
+*/
+static bool taskdriver_task_active(loff_t pos)
+{
+	struct taskdriver_task_stats *t;
+
+	t = &taskdriver_devices[pos / TASKDRIVER_MAX_TASKS].tasks[pos % TASKDRIVER_MAX_TASKS].s;
+	return READ_ONCE(t->jobs) || READ_ONCE(t->start) || READ_ONCE(t->unpaired) ||
+	       READ_ONCE(t->kreleases) || READ_ONCE(t->activations);
+}
+
+static void *taskdriver_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	for (++*pos; *pos < (loff_t)taskdriver_nready * TASKDRIVER_MAX_TASKS; ++*pos)
+		if (taskdriver_task_active(*pos))
+			return pos;
+	return NULL;
+}
+
+static void *taskdriver_seq_start(struct seq_file *m, loff_t *pos)
+{
+	if (*pos >= (loff_t)taskdriver_nready * TASKDRIVER_MAX_TASKS)
+		return NULL;
+	if (taskdriver_task_active(*pos))
+		return pos;
+	return taskdriver_seq_next(m, NULL, pos);
+}
+
+static void taskdriver_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int taskdriver_seq_show(struct seq_file *m, void *v)
+{
+	loff_t pos = *(loff_t *)v;
+	int index = pos / TASKDRIVER_MAX_TASKS, task = pos % TASKDRIVER_MAX_TASKS;
+	struct taskdriver_task *t = &taskdriver_devices[index].tasks[task];
+	struct taskdriver_task_stats snap;
+	unsigned int seq;
+	int b;
+
+	do {
+		seq = read_seqbegin(&t->lock);
+		snap = t->s;
+	} while (read_seqretry(&t->lock, seq));
+
+	seq_printf(m, "taskdriver%d task %d\n", index, task);
+	seq_printf(m, "  jobs %llu unpaired %llu\n", snap.jobs, snap.unpaired);
+	if (snap.jobs)
+		seq_printf(m, "  exec us min %llu avg %llu max %llu\n",
+			   div_u64(snap.exec_min, NSEC_PER_USEC),
+			   div64_u64(snap.exec_sum, snap.jobs * NSEC_PER_USEC),
+			   div_u64(snap.exec_max, NSEC_PER_USEC));
+	if (snap.releases)
+		seq_printf(m, "  release us min %llu avg %llu max %llu jitter %llu\n",
+			   div_u64(snap.period_min, NSEC_PER_USEC),
+			   div64_u64(snap.period_sum, snap.releases * NSEC_PER_USEC),
+			   div_u64(snap.period_max, NSEC_PER_USEC),
+			   div_u64(snap.period_max - snap.period_min, NSEC_PER_USEC));
+	if (snap.kreleases)
+		seq_printf(m, "  timer releases %llu overruns %llu\n",
+			   snap.kreleases, snap.overruns);
+	if (snap.waits)
+		seq_printf(m, "  wake up us min %llu avg %llu max %llu\n",
+			   div_u64(snap.wake_min, NSEC_PER_USEC),
+			   div64_u64(snap.wake_sum, snap.waits * NSEC_PER_USEC),
+			   div_u64(snap.wake_max, NSEC_PER_USEC));
+	if (snap.activations)
+		seq_printf(m, "  activations %llu pending max %llu\n",
+			   snap.activations, snap.act_pending_max);
+	if (snap.act_starts)
+		seq_printf(m, "  activation to start us min %llu avg %llu max %llu\n",
+			   div_u64(snap.act_min, NSEC_PER_USEC),
+			   div64_u64(snap.act_sum, snap.act_starts * NSEC_PER_USEC),
+			   div_u64(snap.act_max, NSEC_PER_USEC));
+	if (snap.jobs) {
+		/* bucket b holds [2^(b-1), 2^b) us, bucket 0 less than 1 us */
+		seq_puts(m, "  exec hist us");
+		for (b = 0; b < TASKDRIVER_HIST_BUCKETS; b++)
+			if (snap.hist[b])
+				seq_printf(m, " %lu:%u", b ? 1UL << (b - 1) : 0UL, snap.hist[b]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static const struct seq_operations taskdriver_seq_ops = {
+	.start = taskdriver_seq_start,
+	.next  = taskdriver_seq_next,
+	.stop  = taskdriver_seq_stop,
+	.show  = taskdriver_seq_show
+};
+
+static int taskdriver_proc_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &taskdriver_seq_ops);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops taskdriver_proc_ops = {
+	.proc_open    = taskdriver_proc_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = seq_release
+};
+#else
+static const struct file_operations taskdriver_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = taskdriver_proc_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release
+};
+#endif
+
 
 struct file_operations taskdriver_fops = {
          .owner =    THIS_MODULE,
          .read =     taskdriver_read,
          .write =    taskdriver_write,
+         .poll =     taskdriver_poll,
+         .mmap =     taskdriver_mmap,
+         .unlocked_ioctl = taskdriver_ioctl,
+         .compat_ioctl = compat_ptr_ioctl,
          .open =     taskdriver_open,
          .release =  taskdriver_release,
 };
 
+static void taskdriver_free_rings(struct taskdriver_dev *dev)
+{
+	int cpu;
+
+	if (!dev->rings)
+		return;
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dev->rings, cpu)->slots);
+	free_percpu(dev->rings);
+	dev->rings = NULL;
+}
+
+static int taskdriver_alloc_rings(struct taskdriver_dev *dev)
+{
+	struct taskdriver_ring *ring;
+	int cpu;
+
+	/* round the per-CPU memory down to a power of two number of slots */
+	dev->nslots = memsize / sizeof(struct taskdriver_event);
+	if (dev->nslots < 2)
+		dev->nslots = 2;
+	dev->nslots = rounddown_pow_of_two(dev->nslots);
+
+	dev->rings = alloc_percpu(struct taskdriver_ring);
+	if (!dev->rings)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(dev->rings, cpu);
+		ring->mask = dev->nslots - 1;
+		ring->slots = kcalloc_node(dev->nslots, sizeof(*ring->slots),
+					   GFP_KERNEL, cpu_to_node(cpu));
+		if (!ring->slots) {
+			taskdriver_free_rings(dev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 void taskdriver_cleanup_module(void)
 {
          dev_t devno = MKDEV(taskdriver_major, taskdriver_minor);
+         struct taskdriver_dev *dev;
+         int i;
  
-         /* Free the cdev entries  */
-         cdev_del(&taskdriver_device.cdev);
+         if (taskdriver_proc)
+                 remove_proc_entry("taskdriver", NULL);
 
-	 /* Free the memory */
-         kfree(taskdriver_device.data);
+         if (taskdriver_devices) {
+                 for (i = 0; i < taskdriver_nready; i++) {
+                         dev = &taskdriver_devices[i];
 
-	 unregister_chrdev_region(devno, 1);
+                         /* Free the cdev entries  */
+                         if (taskdriver_class)
+                                 device_destroy(taskdriver_class, devno + i);
+                         cdev_del(&dev->cdev);
+                         cancel_delayed_work_sync(&dev->watch);
+                         cancel_delayed_work_sync(&dev->logwork);
+
+                         /* Free the memory */
+                         taskdriver_free_rings(dev);
+                         vfree(dev->tasks);
+                 }
+                 kfree(taskdriver_devices);
+         }
+         if (taskdriver_class)
+                 class_destroy(taskdriver_class);
+
+	 unregister_chrdev_region(devno, ndevices);
+}
+
+/*
+* Set up the char device structure for one channel.
+*/
+static void taskdriver_setup_cdev(struct taskdriver_dev *dev, int index)
+{
+        int err, devno = MKDEV(taskdriver_major, taskdriver_minor + index);
+
+        cdev_init(&dev->cdev, &taskdriver_fops);
+        dev->cdev.owner = THIS_MODULE;
+        dev->cdev.ops = &taskdriver_fops;
+        err = cdev_add (&dev->cdev, devno, 1);
+
+        if (err)  printk(KERN_NOTICE "Error %d adding taskdriver%d", err, index);
+        else if (taskdriver_class)
+                device_create(taskdriver_class, NULL, devno, NULL, "taskdriver%d", index);
 }
 
 int taskdriver_init_module(void)
 {
-         int result, err;
+         int result, i, j;
          dev_t dev = 0;
+         struct taskdriver_dev *tdev;
  
+         if (ndevices < 1)
+                 return -EINVAL;
 
 	 if (taskdriver_major) {   //the major number is given as a parameter
 	            dev = MKDEV(taskdriver_major, taskdriver_minor);
-	            result = register_chrdev_region(dev, 1, "taskdriver");
+	            result = register_chrdev_region(dev, ndevices, "taskdriver");
 	 } 
 	 else {		// otherwise
-                 result = alloc_chrdev_region(&dev, taskdriver_minor, 1, "taskdriver");
+                 result = alloc_chrdev_region(&dev, taskdriver_minor, ndevices, "taskdriver");
                  taskdriver_major = MAJOR(dev);
 	 }
 	if (result < 0) {
@@ -166,26 +1428,68 @@ int taskdriver_init_module(void)
                  return result;
         }
 
-	/* Prepare the memory area */
-	taskdriver_device.memsize = memsize;
-	taskdriver_device.data = kmalloc(memsize * sizeof(char), GFP_KERNEL);
-        memset(taskdriver_device.data, 0, memsize * sizeof(char));
+        /* the nodes are created by udev; without a class use mknod as before */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+        taskdriver_class = class_create("taskdriver");
+#else
+        taskdriver_class = class_create(THIS_MODULE, "taskdriver");
+#endif
+        if (IS_ERR(taskdriver_class))
+                taskdriver_class = NULL;
 
-        /* Initialize the semaphore */
-        sema_init(&taskdriver_device.sem,1);
+        /* one independent channel per minor */
+        taskdriver_devices = kcalloc(ndevices, sizeof(struct taskdriver_dev), GFP_KERNEL);
+        if (!taskdriver_devices) {
+                result = -ENOMEM;
+                goto fail;
+        }
 
-	/* Initialize cdev */
-        cdev_init(&taskdriver_device.cdev, &taskdriver_fops);
-        taskdriver_device.cdev.owner = THIS_MODULE;
-        taskdriver_device.cdev.ops = &taskdriver_fops;
-        err = cdev_add (&taskdriver_device.cdev, dev, 1);
+        for (i = 0; i < ndevices; i++) {
+                tdev = &taskdriver_devices[i];
+                tdev->index = i;
 
-        if (err)  printk(KERN_NOTICE "Error %d adding taskdriver", err);
-	else
-        	printk(KERN_NOTICE "taskdriver Added major: %d minor: %d", taskdriver_major, taskdriver_minor);
- 
+                /* Prepare the per-CPU rings and the task statistics */
+                result = taskdriver_alloc_rings(tdev);
+                if (result < 0)
+                        goto fail;
+                tdev->tasks = vzalloc(TASKDRIVER_MAX_TASKS * sizeof(*tdev->tasks));
+                if (!tdev->tasks) {
+                        taskdriver_free_rings(tdev);
+                        result = -ENOMEM;
+                        goto fail;
+                }
+                for (j = 0; j < TASKDRIVER_MAX_TASKS; j++) {
+                        seqlock_init(&tdev->tasks[j].lock);
+                        spin_lock_init(&tdev->tasks[j].act_lock);
+                        init_waitqueue_head(&tdev->tasks[j].actq);
+                }
+
+                /* Initialize the locks */
+                mutex_init(&tdev->lock);
+                seqlock_init(&tdev->stats_seq);
+                INIT_LIST_HEAD(&tdev->mapped);
+                INIT_DELAYED_WORK(&tdev->watch, taskdriver_watch);
+                INIT_DELAYED_WORK(&tdev->logwork, taskdriver_logwork);
+                init_waitqueue_head(&tdev->readq);
+
+                /* Initialize cdev */
+                taskdriver_setup_cdev(tdev, i);
+                taskdriver_nready++;
+        }
+
+        taskdriver_proc = proc_create("taskdriver", 0, NULL, &taskdriver_proc_ops);
+        if (!taskdriver_proc) {
+                result = -ENOMEM;
+                goto fail;
+        }
+
+        printk(KERN_NOTICE "taskdriver Added major: %d minor: %d devices: %d",
+               taskdriver_major, taskdriver_minor, ndevices);
         return 0; 
 
+fail:
+        taskdriver_cleanup_module();
+        return result;
 }
 
 module_init(taskdriver_init_module);
@@ -0,0 +1,195 @@
+/*
+* taskdriver.h -- definitions shared by the taskdriver module and user space
+*
+*/
+
+#ifndef _TASKDRIVER_H_
+#define _TASKDRIVER_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+* One binary trace record. The timestamp is CLOCK_MONOTONIC in nanoseconds
+* (ktime_get_ns() in the kernel) and is the key used to merge the rings.
+* The driver stamps ts and cpu itself for records submitted by write() or
+* ioctl(), unless an ioctl() record carries TASKDRIVER_EVF_USER_TS: then
+* ts and cpu are kept as given, like those of records stored in a mapped
+* ring. Records stamped in user space and submitted late may be read after
+* newer ones.
+*/
+enum taskdriver_event_type {
+	TASKDRIVER_EV_START = 1,	/* job start, the "[n" marker */
+	TASKDRIVER_EV_END,		/* job end, the "n]" marker */
+	TASKDRIVER_EV_RELEASE,		/* release by a driver timer, arg is
+					   the number of releases still pending */
+	TASKDRIVER_EV_ACTIVATE,		/* aperiodic activation posted, arg is
+					   the number of activations pending */
+	TASKDRIVER_EV_PREEMPT,		/* the job of task was preempted by a
+					   job of task arg */
+	TASKDRIVER_EV_MAX
+};
+
+#define TASKDRIVER_EVF_USER_TS	0x0001
+#define TASKDRIVER_CPU_UNKNOWN	0xffff
+
+struct taskdriver_event {
+	__u64 ts;
+	__u32 job;
+	__u16 task;
+	__u16 cpu;
+	__u16 type;
+	__u16 flags;
+	__u32 arg;		/* type specific, 0 if unused */
+};
+
+/* tasks are numbered 0 .. TASKDRIVER_MAX_TASKS - 1 */
+#define TASKDRIVER_MAX_TASKS	256
+
+
+/*
+* ioctl commands.
+*
+* TASKDRIVER_IOC_EVENT	submit one record; task, type, job and arg are taken
+*			from the argument, ts and cpu are filled in by the driver
+*			(see TASKDRIVER_EVF_USER_TS above)
+* TASKDRIVER_IOC_BATCH	submit up to TASKDRIVER_MAX_BATCH records in one call,
+*			all those the driver stamps at the same time; returns
+*			the number of records accepted
+* TASKDRIVER_IOC_GET_STATS	read the counters of the channel
+* TASKDRIVER_IOC_SET_PERIOD	make the file periodic: a driver hrtimer
+*			releases the task every period_ns from start_ns (0 for
+*			one period from now); period_ns 0 stops it
+* TASKDRIVER_IOC_WAIT_RELEASE	block until the next release of the file and
+*			return it; EAGAIN instead with O_NONBLOCK
+* TASKDRIVER_IOC_ACTIVATE	post an activation of an aperiodic task of the
+*			channel; activations are counted, none is lost
+* TASKDRIVER_IOC_WAIT_ACTIVATION	take the oldest pending activation of the
+*			task, blocking until there is one (EAGAIN with
+*			O_NONBLOCK)
+*/
+#define TASKDRIVER_MAX_BATCH	1024
+
+struct taskdriver_batch {
+	__u64 events;		/* user pointer to struct taskdriver_event[] */
+	__u32 count;
+	__u32 pad;
+};
+
+struct taskdriver_stats {
+	__u64 events;		/* events appended to the per-CPU rings */
+	__u64 dropped;		/* events lost because a per-CPU ring was full */
+	__u64 mapped_events;	/* events drained from mapped rings */
+	__u64 mapped_dropped;	/* events lost because a mapped ring was full */
+	__u64 read_events;	/* events returned by read() */
+	__u32 mapped;		/* files with a ring mapped */
+	__u32 nslots;		/* slots of each per-CPU ring */
+
+	/* critical section times, only counted while lockstat=1 */
+	__u64 appends;		/* writer sections (per-CPU ring appends) */
+	__u64 append_hold_ns;
+	__u64 append_hold_max_ns;
+	__u64 reads;		/* reader sections (dev->lock held) */
+	__u64 read_hold_ns;
+	__u64 read_hold_max_ns;
+};
+
+#define TASKDRIVER_MIN_PERIOD	10000	/* ns */
+
+struct taskdriver_period {
+	__u64 period_ns;
+	__u64 start_ns;		/* CLOCK_MONOTONIC time of the first release */
+	__u16 task;		/* task id the releases are accounted to */
+	__u16 pad[3];
+};
+
+struct taskdriver_release {
+	__u64 release_ns;	/* nominal CLOCK_MONOTONIC release time */
+	__u64 wakeup_ns;	/* when the driver returned it */
+	__u32 job;		/* release number, from 1 */
+	__u32 pending;		/* later releases that already happened */
+};
+
+struct taskdriver_activation {
+	__u64 post_ns;		/* CLOCK_MONOTONIC time it was posted, 0 if
+				   too many piled up to remember it */
+	__u64 wakeup_ns;	/* when the driver returned it */
+	__u32 job;		/* activation number, from 1 */
+	__u32 pending;		/* activations still pending after this one */
+	__u16 task;		/* the only field ACTIVATE reads */
+	__u16 pad[3];
+};
+
+#define TASKDRIVER_IOC_MAGIC	't'
+#define TASKDRIVER_IOC_EVENT	_IOW(TASKDRIVER_IOC_MAGIC, 1, struct taskdriver_event)
+#define TASKDRIVER_IOC_BATCH	_IOW(TASKDRIVER_IOC_MAGIC, 2, struct taskdriver_batch)
+#define TASKDRIVER_IOC_GET_STATS _IOR(TASKDRIVER_IOC_MAGIC, 3, struct taskdriver_stats)
+#define TASKDRIVER_IOC_SET_PERIOD _IOW(TASKDRIVER_IOC_MAGIC, 4, struct taskdriver_period)
+#define TASKDRIVER_IOC_WAIT_RELEASE _IOR(TASKDRIVER_IOC_MAGIC, 5, struct taskdriver_release)
+#define TASKDRIVER_IOC_ACTIVATE	_IOW(TASKDRIVER_IOC_MAGIC, 6, struct taskdriver_activation)
+#define TASKDRIVER_IOC_WAIT_ACTIVATION _IOWR(TASKDRIVER_IOC_MAGIC, 7, struct taskdriver_activation)
+
+
+/*
+* Layout of the ring exposed by mmap() on /dev/taskdriverN. Each open file
+* gets its own ring: user space is the single producer and only writes
+* head, the driver is the single consumer and only writes tail. The two
+* indices live on separate cache lines and are free running; the slot of
+* index i is slots[i & (nslots - 1)].
+*
+* The mapping must be MAP_SHARED at offset 0; its length decides nslots,
+* rounded down to a power of two. Slots hold struct taskdriver_event.
+*/
+#define TASKDRIVER_MMAP_MAGIC	0x54445231	/* "TDR1" */
+
+struct taskdriver_mmap_ring {
+	__u32 magic;
+	__u32 nslots;
+	__u32 pad0[14];
+	__u32 head;		/* next slot to fill, written by user space */
+	__u32 pad1[15];
+	__u32 tail;		/* next slot to drain, written by the driver */
+	__u32 dropped;		/* events user space could not store */
+	__u32 pad2[14];
+	struct taskdriver_event slots[];
+};
+
+
+#ifndef __KERNEL__
+#include <time.h>
+
+/*
+* Record an event in a mapped ring with plain stores, no system call.
+* Only one thread may record into a given ring. Returns 0, or -1 if the
+* ring is full and the event was dropped.
+*/
+static inline int taskdriver_mmap_record(struct taskdriver_mmap_ring *ring,
+					 unsigned int task, unsigned int type,
+					 unsigned int job)
+{
+	struct taskdriver_event *e;
+	struct timespec now;
+	__u32 head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->nslots) {
+		ring->dropped++;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	e = &ring->slots[head & (ring->nslots - 1)];
+	e->ts = (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	e->job = job;
+	e->task = task;
+	e->cpu = TASKDRIVER_CPU_UNKNOWN;
+	e->type = type;
+	e->flags = TASKDRIVER_EVF_USER_TS;
+	e->arg = 0;
+
+	/* publish the event before the driver can see the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif
+
+#endif /* _TASKDRIVER_H_ */
@@ -0,0 +1,106 @@
+/*
+* tdsession.h -- per-thread tracing session on a taskdriver channel
+*
+* A session keeps the channel open for the life of a thread and collects
+* the events of the thread in a buffer of its own, stamped when they
+* happen. The buffer reaches the driver in one TASKDRIVER_IOC_BATCH call
+* when the thread flushes it, at the end of a job, or when it fills up.
+* A session belongs to one thread; declare it __thread or keep it on the
+* thread's stack.
+*
+* sched_getcpu() needs _GNU_SOURCE, which g++ defines by default.
+*/
+
+#ifndef _TDSESSION_H_
+#define _TDSESSION_H_
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "taskdriver.h"
+
+#define TD_SESSION_EVENTS	64	/* events buffered before a forced flush */
+
+struct td_session {
+	int fd;			/* -1 if the session is not open */
+	unsigned int n;		/* events in ev[] */
+	unsigned long dropped;	/* events the driver did not take */
+	struct taskdriver_event ev[TD_SESSION_EVENTS];
+};
+
+/*
+* Start a session on an open channel; the session owns fd from now on.
+* Returns -1 if fd is not valid: the session then records nothing.
+*/
+static inline int td_session_open(struct td_session *s, int fd)
+{
+	s->fd = fd;
+	s->n = 0;
+	s->dropped = 0;
+	return fd < 0 ? -1 : 0;
+}
+
+/*
+* Hand the buffered events to the driver. Returns the number of events
+* the driver took, or -1 on error.
+*/
+static inline int td_session_flush(struct td_session *s)
+{
+	struct taskdriver_batch batch;
+	int ret;
+
+	if (s->n == 0 || s->fd < 0)
+		return 0;
+	batch.events = (__u64)(unsigned long)s->ev;
+	batch.count = s->n;
+	batch.pad = 0;
+	ret = ioctl(s->fd, TASKDRIVER_IOC_BATCH, &batch);
+	s->dropped += ret < 0 ? s->n : s->n - ret;
+	s->n = 0;
+	return ret;
+}
+
+/*
+* Record an event of the calling thread, flushing first if the buffer is
+* full. No system call otherwise.
+*/
+static inline void td_session_record(struct td_session *s, unsigned int task,
+				     unsigned int type, unsigned int job)
+{
+	struct taskdriver_event *e;
+	struct timespec now;
+	int cpu;
+
+	if (s->fd < 0)
+		return;
+	if (s->n == TD_SESSION_EVENTS)
+		td_session_flush(s);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cpu = sched_getcpu();
+	e = &s->ev[s->n++];
+	e->ts = (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	e->job = job;
+	e->task = task;
+	e->cpu = cpu < 0 ? TASKDRIVER_CPU_UNKNOWN : cpu;
+	e->type = type;
+	e->flags = TASKDRIVER_EVF_USER_TS;
+	e->arg = 0;
+}
+
+/*
+* Flush what is left and close the channel.
+*/
+static inline void td_session_close(struct td_session *s)
+{
+	if (s->fd < 0)
+		return;
+	td_session_flush(s);
+	close(s->fd);
+	s->fd = -1;
+}
+
+#endif /* _TDSESSION_H_ */
@@ -0,0 +1,549 @@
+//compile with: gcc -O2 tdtrace.c -o tdtrace
+
+//Offline analyzer of the binary traces Tasks.c writes with -T (tdtrace.h).
+//The streams of the trace are merged in time order, optionally with records
+//read from /dev/taskdriverN and saved to a file, and the run is rebuilt:
+//which job ran on each CPU and when, how often each task was preempted, and
+//the response time of every job from its release (or activation) to its end.
+//
+//It prints a summary per task and per CPU and a text Gantt chart with one
+//row per CPU, and with -s writes the same chart as SVG.
+//
+//usage: tdtrace [-w cols] [-f from_ms] [-t to_ms] [-s chart.svg] trace [driver.bin ...]
+//  -w cols   width of the text chart (default 100)
+//  -f, -t    window of the charts, in ms from the first event (default all)
+//  -s file   write an SVG chart of the window to file
+//
+//Driver records of a task, type and job already in the trace are skipped,
+//so a driver capture of the same run can be merged without doubling it.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "taskdriver.h"
+#include "tdtrace.h"
+
+#define MAXCPUS		256
+#define MAXDEPTH	32	//jobs stacked on one CPU by preemptions
+
+struct segment {
+	__u64 from, to;
+	__u32 job;
+	__u16 task, cpu;
+};
+
+struct running {
+	__u16 task;
+	__u32 job;
+};
+
+struct task_stats {
+	__u64 period, deadline;	//from the trace header, 0 if unknown
+	__u64 *release;		//release time of each job, 0 if not seen
+	__u32 nrelease;
+	__u64 jobs, missed, preempted, preempt_records;
+	__u64 resp_min, resp_max, resp_sum, responses;
+	__u64 start_sum, starts;
+};
+
+struct taskdriver_event *ev;
+size_t nev, evsize;
+
+struct segment *seg;
+size_t nseg, segsize;
+
+struct task_stats tasks[TASKDRIVER_MAX_TASKS];
+struct running stack[MAXCPUS][MAXDEPTH];
+int depth[MAXCPUS];
+__u64 since[MAXCPUS];		//start of the segment on top of each CPU
+__u64 busy[MAXCPUS];
+int ncpus;
+
+int cols = 100;
+double from_ms = 0, to_ms = -1;
+const char *svg;
+
+
+static void add_event(const struct taskdriver_event *e)
+{
+	if (nev == evsize) {
+		evsize = evsize ? 2 * evsize : 4096;
+		if ((ev = (struct taskdriver_event *)realloc(ev, evsize * sizeof(*ev))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ev[nev++] = *e;
+}
+
+static void add_segment(int cpu, const struct running *r, __u64 from, __u64 to)
+{
+	if (to <= from)
+		return;
+	if (nseg == segsize) {
+		segsize = segsize ? 2 * segsize : 4096;
+		if ((seg = (struct segment *)realloc(seg, segsize * sizeof(*seg))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	seg[nseg].from = from;
+	seg[nseg].to = to;
+	seg[nseg].job = r->job;
+	seg[nseg].task = r->task;
+	seg[nseg].cpu = cpu;
+	nseg++;
+	busy[cpu] += to - from;
+}
+
+static void *load_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	void *buf;
+	long len;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) == -1 || (len = ftell(f)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	rewind(f);
+	if ((buf = malloc(len ? len : 1)) == NULL || fread(buf, 1, len, f) != (size_t)len) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	*size = len;
+	return buf;
+}
+
+//all the streams of a trace file; returns the number of records
+static size_t load_trace(const char *path)
+{
+	struct tdtrace_header *h;
+	struct tdtrace_stream *s;
+	struct taskdriver_event *slots;
+	size_t size, n = 0;
+	__u64 i, count;
+	unsigned int k;
+
+	h = (struct tdtrace_header *)load_file(path, &size);
+	if (size < sizeof(*h) || h->magic != TDTRACE_MAGIC ||
+	    size < tdtrace_size(h->nstreams, h->nslots)) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		exit(1);
+	}
+	for (k = 0; k < h->nstreams; k++) {
+		s = tdtrace_stream(h, k);
+		slots = tdtrace_slots(h, k);
+		count = s->count < h->nslots ? s->count : h->nslots;
+		if (s->task < TASKDRIVER_MAX_TASKS) {
+			tasks[s->task].period = s->period_ns;
+			tasks[s->task].deadline = s->deadline_ns;
+		}
+		if (s->dropped)
+			fprintf(stderr, "%s: task %u lost %llu records, stream full\n",
+				path, s->task, (unsigned long long)s->dropped);
+		for (i = 0; i < count; i++)
+			add_event(&slots[i]);
+		n += count;
+	}
+	free(h);
+	return n;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	const struct taskdriver_event *x = (const struct taskdriver_event *)a;
+	const struct taskdriver_event *y = (const struct taskdriver_event *)b;
+
+	if (x->task != y->task)
+		return x->task < y->task ? -1 : 1;
+	if (x->type != y->type)
+		return x->type < y->type ? -1 : 1;
+	if (x->job != y->job)
+		return x->job < y->job ? -1 : 1;
+	return 0;
+}
+
+static int cmp_ts(const void *a, const void *b)
+{
+	const struct taskdriver_event *x = (const struct taskdriver_event *)a;
+	const struct taskdriver_event *y = (const struct taskdriver_event *)b;
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	//at the same time a job ends before another starts
+	if (x->type == TASKDRIVER_EV_END)
+		return y->type == TASKDRIVER_EV_END ? 0 : -1;
+	return y->type == TASKDRIVER_EV_END;
+}
+
+//records read from the driver, minus those the trace has already and those
+//outside the span of the trace, such as the jobs run to measure the WCET
+static void load_driver(const char *path, size_t ntrace)
+{
+	struct taskdriver_event *drv;
+	size_t size, i, n, skipped = 0, outside = 0;
+	__u64 first = ~0ULL, last = 0;
+
+	drv = (struct taskdriver_event *)load_file(path, &size);
+	n = size / sizeof(*drv);
+	for (i = 0; i < ntrace; i++) {
+		if (ev[i].ts < first)
+			first = ev[i].ts;
+		if (ev[i].ts > last)
+			last = ev[i].ts;
+	}
+	qsort(ev, ntrace, sizeof(*ev), cmp_key);
+	for (i = 0; i < n; i++) {
+		if (drv[i].type == 0 || drv[i].type >= TASKDRIVER_EV_MAX)
+			continue;
+		if (drv[i].ts < first || drv[i].ts > last) {
+			outside++;
+			continue;
+		}
+		if (bsearch(&drv[i], ev, ntrace, sizeof(*ev), cmp_key)) {
+			skipped++;
+			continue;
+		}
+		add_event(&drv[i]);
+	}
+	fprintf(stderr, "%s: %zu driver records, %zu already in the trace, %zu outside it\n",
+		path, n, skipped, outside);
+	free(drv);
+}
+
+
+static void set_release(int task, __u32 job, __u64 ts)
+{
+	struct task_stats *t = &tasks[task];
+
+	if (job >= t->nrelease) {
+		__u32 n = job + 1024;
+		if ((t->release = (__u64 *)realloc(t->release, n * sizeof(__u64))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(t->release + t->nrelease, 0, (n - t->nrelease) * sizeof(__u64));
+		t->nrelease = n;
+	}
+	t->release[job] = ts;
+}
+
+static __u64 release_of(int task, __u32 job)
+{
+	return job < tasks[task].nrelease ? tasks[task].release[job] : 0;
+}
+
+static void job_start(const struct taskdriver_event *e)
+{
+	int c = e->cpu;
+	__u64 rel = release_of(e->task, e->job);
+
+	if (rel && e->ts >= rel) {
+		tasks[e->task].start_sum += e->ts - rel;
+		tasks[e->task].starts++;
+	}
+	if (depth[c]) {
+		struct running *top = &stack[c][depth[c] - 1];
+
+		add_segment(c, top, since[c], e->ts);
+		tasks[top->task].preempted++;
+	}
+	if (depth[c] == MAXDEPTH) {
+		//an end was lost: forget the oldest job of the CPU
+		memmove(&stack[c][0], &stack[c][1], (MAXDEPTH - 1) * sizeof(stack[c][0]));
+		depth[c]--;
+	}
+	stack[c][depth[c]].task = e->task;
+	stack[c][depth[c]].job = e->job;
+	depth[c]++;
+	since[c] = e->ts;
+}
+
+static void job_end(const struct taskdriver_event *e)
+{
+	struct task_stats *t = &tasks[e->task];
+	__u64 rel = release_of(e->task, e->job), r;
+	int c, i = -1, k;
+
+	//the job may have migrated: look for it on its CPU first
+	for (k = 0; k < ncpus; k++) {
+		c = (e->cpu + k) % ncpus;
+		for (i = depth[c] - 1; i >= 0; i--)
+			if (stack[c][i].task == e->task && stack[c][i].job == e->job)
+				break;
+		if (i >= 0)
+			break;
+	}
+	if (i < 0)
+		return;		//started before the trace
+
+	if (i == depth[c] - 1) {
+		add_segment(c, &stack[c][i], since[c], e->ts);
+		since[c] = e->ts;
+	}
+	memmove(&stack[c][i], &stack[c][i + 1], (depth[c] - i - 1) * sizeof(stack[c][0]));
+	depth[c]--;
+
+	t->jobs++;
+	if (!rel || e->ts < rel)
+		return;
+	r = e->ts - rel;
+	if (!t->responses || r < t->resp_min)
+		t->resp_min = r;
+	if (r > t->resp_max)
+		t->resp_max = r;
+	t->resp_sum += r;
+	t->responses++;
+	if (t->deadline && r > t->deadline)
+		t->missed++;
+}
+
+static void replay(void)
+{
+	const struct taskdriver_event *e;
+	int preempt_records = 0;
+	size_t i;
+
+	for (i = 0; i < nev; i++) {
+		e = &ev[i];
+		if (e->task >= TASKDRIVER_MAX_TASKS)
+			continue;
+		switch (e->type) {
+		case TASKDRIVER_EV_RELEASE:
+		case TASKDRIVER_EV_ACTIVATE:
+			set_release(e->task, e->job, e->ts);
+			break;
+		case TASKDRIVER_EV_START:
+			if (e->cpu < MAXCPUS)
+				job_start(e);
+			break;
+		case TASKDRIVER_EV_END:
+			if (e->cpu < MAXCPUS)
+				job_end(e);
+			break;
+		case TASKDRIVER_EV_PREEMPT:
+			tasks[e->task].preempt_records++;
+			preempt_records = 1;
+			break;
+		}
+	}
+	//the recorder saw the preemptions as they happened, use its count
+	if (preempt_records)
+		for (i = 0; i < TASKDRIVER_MAX_TASKS; i++)
+			tasks[i].preempted = tasks[i].preempt_records;
+}
+
+
+static void summary(__u64 t0, __u64 t1)
+{
+	struct task_stats *t;
+	int i;
+
+	printf("%llu events, %.3f ms, %zu execution segments\n\n",
+	       (unsigned long long)nev, (t1 - t0) / 1e6, nseg);
+	printf("task   period_us deadline_us  jobs  missed  preempted  start_us avg  response_us min/avg/max\n");
+	for (i = 0; i < TASKDRIVER_MAX_TASKS; i++) {
+		t = &tasks[i];
+		if (!t->jobs && !t->nrelease)
+			continue;
+		printf("%4d %11.1f %11.1f %5llu %7llu %10llu %13.1f", i, t->period / 1e3,
+		       t->deadline / 1e3, (unsigned long long)t->jobs,
+		       (unsigned long long)t->missed, (unsigned long long)t->preempted,
+		       t->starts ? (double)t->start_sum / t->starts / 1e3 : 0);
+		if (t->responses)
+			printf("  %.1f/%.1f/%.1f", t->resp_min / 1e3,
+			       (double)t->resp_sum / t->responses / 1e3, t->resp_max / 1e3);
+		printf("\n");
+	}
+	printf("\ncpu  busy\n");
+	for (i = 0; i < ncpus; i++)
+		if (busy[i])
+			printf("%3d  %5.1f%%\n", i, 100.0 * busy[i] / (t1 - t0));
+}
+
+//one character per task: 1-9, A-Z, a-z, then #
+static char task_char(int task)
+{
+	if (task >= 1 && task <= 9)
+		return '0' + task;
+	if (task >= 10 && task < 36)
+		return 'A' + task - 10;
+	if (task >= 36 && task < 62)
+		return 'a' + task - 36;
+	return '#';
+}
+
+//each column shows the task that runs for the longest part of it, all its
+//jobs there added up, '.' if the CPU is idle all of it; a job shorter than
+//a column still marks it
+static void text_chart(__u64 from, __u64 to)
+{
+	char *row = (char *)malloc(cols + 1);
+	//time each task runs in each column, cols rows of TASKDRIVER_MAX_TASKS
+	double *cover = (double *)malloc((size_t)cols * TASKDRIVER_MAX_TASKS * sizeof(double));
+	double width = (double)(to - from) / cols, lo, hi, start, end, *col, best;
+	size_t i;
+	int c, k, first, last, task;
+
+	if (row == NULL || cover == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	printf("\n%.3f .. %.3f ms, %.1f us per column\n", from_ms, from_ms + (to - from) / 1e6,
+	       width / 1e3);
+	for (c = 0; c < ncpus; c++) {
+		if (!busy[c])
+			continue;
+		memset(cover, 0, (size_t)cols * TASKDRIVER_MAX_TASKS * sizeof(double));
+		for (i = 0; i < nseg; i++) {
+			if (seg[i].cpu != c || seg[i].to <= from || seg[i].from >= to)
+				continue;
+			start = seg[i].from > from ? seg[i].from - from : 0;
+			end = (seg[i].to < to ? seg[i].to : to) - from;
+			first = (int)(start / width);
+			last = (int)(end / width);
+			for (k = first; k <= last && k < cols; k++) {
+				//part of [from + k * width, from + (k + 1) * width) it covers
+				lo = start > k * width ? start : k * width;
+				hi = end < (k + 1) * width ? end : (k + 1) * width;
+				if (hi > lo)
+					cover[(size_t)k * TASKDRIVER_MAX_TASKS + seg[i].task] += hi - lo;
+			}
+		}
+		for (k = 0; k < cols; k++) {
+			col = &cover[(size_t)k * TASKDRIVER_MAX_TASKS];
+			row[k] = '.';
+			best = 0;
+			for (task = 0; task < TASKDRIVER_MAX_TASKS; task++)
+				if (col[task] > best) {
+					best = col[task];
+					row[k] = task_char(task);
+				}
+		}
+		row[cols] = '\0';
+		printf("cpu %3d |%s|\n", c, row);
+	}
+	free(cover);
+	free(row);
+}
+
+static void svg_chart(const char *path, __u64 from, __u64 to)
+{
+	const double left = 60, width = 1200, rowh = 24;
+	double scale = width / (to - from), x0, x1;
+	FILE *f = fopen(path, "w");
+	int c, row = 0, k;
+	size_t i;
+
+	if (f == NULL) {
+		perror(path);
+		return;
+	}
+	fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%.0f\" height=\"%.0f\""
+		" font-family=\"monospace\" font-size=\"11\">\n",
+		left + width + 20, (ncpus + 2) * rowh);
+	for (c = 0; c < ncpus; c++) {
+		if (!busy[c])
+			continue;
+		fprintf(f, "<text x=\"4\" y=\"%.0f\">cpu %d</text>\n", (row + 0.7) * rowh, c);
+		for (i = 0; i < nseg; i++) {
+			if (seg[i].cpu != c || seg[i].to <= from || seg[i].from >= to)
+				continue;
+			x0 = left + ((seg[i].from > from ? seg[i].from : from) - from) * scale;
+			x1 = left + ((seg[i].to < to ? seg[i].to : to) - from) * scale;
+			fprintf(f, "<rect x=\"%.2f\" y=\"%.0f\" width=\"%.2f\" height=\"%.0f\""
+				" fill=\"hsl(%d,60%%,55%%)\"><title>task %u job %u: %.3f .. %.3f ms</title></rect>\n",
+				x0, row * rowh + 2, x1 - x0 > 0.2 ? x1 - x0 : 0.2, rowh - 4,
+				seg[i].task * 47 % 360, seg[i].task, seg[i].job,
+				(seg[i].from - from) / 1e6 + from_ms, (seg[i].to - from) / 1e6 + from_ms);
+			if (x1 - x0 > 14)
+				fprintf(f, "<text x=\"%.2f\" y=\"%.0f\">%u</text>\n",
+					x0 + 2, (row + 0.7) * rowh, seg[i].task);
+		}
+		row++;
+	}
+	//time axis, ten ticks
+	for (k = 0; k <= 10; k++) {
+		x0 = left + width * k / 10;
+		fprintf(f, "<line x1=\"%.1f\" y1=\"0\" x2=\"%.1f\" y2=\"%.0f\" stroke=\"#ccc\"/>\n",
+			x0, x0, row * rowh);
+		fprintf(f, "<text x=\"%.1f\" y=\"%.0f\" text-anchor=\"middle\">%.2f ms</text>\n",
+			x0, (row + 0.8) * rowh, from_ms + (to - from) / 1e6 * k / 10);
+	}
+	fprintf(f, "</svg>\n");
+	fclose(f);
+}
+
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-w cols] [-f from_ms] [-t to_ms] [-s chart.svg] trace [driver.bin ...]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	__u64 t0, t1, from, to;
+	size_t ntrace;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:f:t:s:")) != -1) {
+		switch (opt) {
+		case 'w':
+			cols = atoi(optarg);
+			break;
+		case 'f':
+			from_ms = atof(optarg);
+			break;
+		case 't':
+			to_ms = atof(optarg);
+			break;
+		case 's':
+			svg = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || cols < 1 || from_ms < 0)
+		usage(argv[0]);
+
+	ntrace = load_trace(argv[optind]);
+	for (i = optind + 1; i < (size_t)argc; i++)
+		load_driver(argv[i], ntrace);
+	if (nev == 0) {
+		fprintf(stderr, "no events\n");
+		return 1;
+	}
+	qsort(ev, nev, sizeof(*ev), cmp_ts);
+	for (i = 0; i < nev; i++)
+		if (ev[i].cpu < MAXCPUS && ev[i].cpu >= ncpus)
+			ncpus = ev[i].cpu + 1;
+
+	replay();
+	t0 = ev[0].ts;
+	t1 = ev[nev - 1].ts;
+	summary(t0, t1);
+
+	from = t0 + (__u64)(from_ms * 1e6);
+	to = to_ms < 0 ? t1 : t0 + (__u64)(to_ms * 1e6);
+	if (to > t1)
+		to = t1;
+	if (to <= from) {
+		fprintf(stderr, "empty window\n");
+		return 1;
+	}
+	text_chart(from, to);
+	if (svg)
+		svg_chart(svg, from, to);
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+* tdtrace.h -- binary trace file written through a shared mapping
+*
+* The file is sized when it is created and mapped MAP_SHARED, so recording
+* an event is a few stores into the page cache: no system call and no copy.
+* It is split in streams, one per writing thread, each with its own count
+* on a cache line of its own; a stream has a single writer and needs no
+* atomic read-modify-write. The records are those of the driver (struct
+* taskdriver_event), so a trace can be merged with what /dev/taskdriverN
+* returns. Each stream is in time order as written; readers merge them.
+*
+* Layout: struct tdtrace_header, nstreams struct tdtrace_stream, then the
+* slots of stream 0, of stream 1, and so on, nslots records each.
+*
+* sched_getcpu() needs _GNU_SOURCE, which g++ defines by default.
+*/
+
+#ifndef _TDTRACE_H_
+#define _TDTRACE_H_
+
+#include "taskdriver.h"
+
+#define TDTRACE_MAGIC	0x54445431	/* "TDT1" */
+
+struct tdtrace_header {
+	__u32 magic;
+	__u32 nstreams;
+	__u64 nslots;		/* records of each stream */
+	__u32 pad[12];
+};
+
+struct tdtrace_stream {
+	__u64 count;		/* records written, written by the owner only */
+	__u64 dropped;		/* records lost because the stream was full */
+	__u64 period_ns;	/* of the task of the stream, 0 if aperiodic */
+	__u64 deadline_ns;	/* relative, 0 for none */
+	__u16 task;
+	__u16 pad[15];
+};
+
+static inline struct taskdriver_event *tdtrace_slots(struct tdtrace_header *h,
+							  unsigned int stream)
+{
+	return (struct taskdriver_event *)((struct tdtrace_stream *)(h + 1) + h->nstreams) +
+	       (__u64)stream * h->nslots;
+}
+
+static inline struct tdtrace_stream *tdtrace_stream(struct tdtrace_header *h,
+						    unsigned int stream)
+{
+	return (struct tdtrace_stream *)(h + 1) + stream;
+}
+
+static inline __u64 tdtrace_size(unsigned int nstreams, __u64 nslots)
+{
+	return sizeof(struct tdtrace_header) + nstreams * sizeof(struct tdtrace_stream) +
+	       nstreams * nslots * sizeof(struct taskdriver_event);
+}
+
+
+#ifndef __KERNEL__
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+* Create the file, size it for nstreams streams of nslots records and map
+* it. Returns NULL on error, with errno set. The pages are only allocated
+* when the streams reach them.
+*/
+static inline struct tdtrace_header *tdtrace_create(const char *path,
+						    unsigned int nstreams,
+						    __u64 nslots)
+{
+	struct tdtrace_header *h;
+	__u64 size = tdtrace_size(nstreams, nslots);
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		return NULL;
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return NULL;
+	}
+	h = (struct tdtrace_header *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return NULL;
+	h->nstreams = nstreams;
+	h->nslots = nslots;
+	h->magic = TDTRACE_MAGIC;
+	return h;
+}
+
+/*
+* Record an event in a stream, on the current CPU and at time ts, 0 for now.
+* Only the owner of the stream may call it. Returns -1 if the stream is full.
+*/
+static inline int tdtrace_record(struct tdtrace_header *h, unsigned int stream,
+				 unsigned int task, unsigned int type,
+				 unsigned int job, unsigned int arg, __u64 ts)
+{
+	struct tdtrace_stream *s = tdtrace_stream(h, stream);
+	struct taskdriver_event *e;
+	struct timespec now;
+	int cpu;
+
+	if (s->count == h->nslots) {
+		s->dropped++;
+		return -1;
+	}
+	if (ts == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts = (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+	cpu = sched_getcpu();
+	e = tdtrace_slots(h, stream) + s->count;
+	e->ts = ts;
+	e->job = job;
+	e->task = task;
+	e->cpu = cpu < 0 ? TASKDRIVER_CPU_UNKNOWN : cpu;
+	e->type = type;
+	e->flags = TASKDRIVER_EVF_USER_TS;
+	e->arg = arg;
+	/* a reader of the live file sees the record before the count */
+	__atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+* Unmap the file; what was recorded is in the page cache already and is
+* written back by the kernel.
+*/
+static inline void tdtrace_close(struct tdtrace_header *h)
+{
+	munmap(h, tdtrace_size(h->nstreams, h->nslots));
+}
+#endif
+
+#endif /* _TDTRACE_H_ */
@@ -0,0 +1,203 @@
+/*
+* workload.h -- synthetic workload kernels for the tasks
+*
+* Each thread runs its kernel on a context of its own: the random number
+* generator and the working set belong to the context, so no two threads
+* share a lock or a cache line while they burn time. A kernel runs a given
+* number of iterations; wl_calibrate() measures the time of one, so that a
+* job can be sized in microseconds instead of iterations.
+*
+* WL_ALU     dependent integer arithmetic, no memory traffic
+* WL_SIMD    floating point multiply-add over a small array, vectorizable
+* WL_STREAM  sequential reads of the working set, one cache line each
+* WL_CHASE   dependent loads at random places of the working set, one cache
+*            line each: with a working set larger than the caches every
+*            iteration is a miss
+*/
+
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum wl_kind {
+	WL_ALU,
+	WL_SIMD,
+	WL_STREAM,
+	WL_CHASE,
+	WL_KINDS
+};
+
+static const char *const wl_names[WL_KINDS] = { "alu", "simd", "stream", "chase" };
+
+#define WL_LINE		64			/* bytes of a cache line */
+#define WL_SIMD_N	256			/* floats of the WL_SIMD arrays */
+#define WL_DEFAULT_WSS	(32UL << 20)		/* bytes, memory kernels */
+
+struct wl_line {
+	uint64_t next;		/* WL_CHASE: line to load after this one */
+	uint64_t val[WL_LINE / sizeof(uint64_t) - 1];
+};
+
+struct wl_ctx {
+	int kind;
+	uint64_t rng;		/* xorshift64* state, never 0 */
+	struct wl_line *mem;	/* working set of the memory kernels */
+	size_t nlines;
+	size_t pos;		/* where the memory kernels go on from */
+	float a[WL_SIMD_N] __attribute__((aligned(WL_LINE)));
+	float b[WL_SIMD_N] __attribute__((aligned(WL_LINE)));
+	volatile uint64_t sink;	/* keeps the results alive */
+};
+
+/*
+* Next number of the generator of the context.
+*/
+static inline uint64_t wl_rand(struct wl_ctx *c)
+{
+	c->rng ^= c->rng >> 12;
+	c->rng ^= c->rng << 25;
+	c->rng ^= c->rng >> 27;
+	return c->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+* Kernel by name, or -1.
+*/
+static inline int wl_kind_of(const char *name)
+{
+	int k;
+
+	for (k = 0; k < WL_KINDS; k++)
+		if (strcmp(name, wl_names[k]) == 0)
+			return k;
+	return -1;
+}
+
+/*
+* Prepare a context; wss is the working set of the memory kernels in bytes,
+* 0 for WL_DEFAULT_WSS. Returns -1 if the working set cannot be allocated.
+*/
+static inline int wl_init(struct wl_ctx *c, int kind, size_t wss, uint64_t seed)
+{
+	size_t i, j;
+	uint64_t tmp;
+	int k;
+
+	memset(c, 0, sizeof(*c));
+	c->kind = kind;
+	c->rng = seed * 0x9e3779b97f4a7c15ULL | 1;
+	for (k = 0; k < WL_SIMD_N; k++) {
+		c->a[k] = (float)(wl_rand(c) & 0xffff) / 65536;
+		c->b[k] = (float)(wl_rand(c) & 0xffff) / 65536;
+	}
+	if (kind != WL_STREAM && kind != WL_CHASE)
+		return 0;
+
+	c->nlines = (wss ? wss : WL_DEFAULT_WSS) / WL_LINE;
+	if (c->nlines < 2)
+		c->nlines = 2;
+	if (posix_memalign((void **)&c->mem, WL_LINE, c->nlines * WL_LINE) != 0) {
+		c->mem = NULL;
+		return -1;
+	}
+	for (i = 0; i < c->nlines; i++) {
+		c->mem[i].next = i;
+		for (j = 0; j < WL_LINE / sizeof(uint64_t) - 1; j++)
+			c->mem[i].val[j] = i + j;
+	}
+	/* one cycle through all the lines in random order (Sattolo) */
+	if (kind == WL_CHASE)
+		for (i = c->nlines - 1; i > 0; i--) {
+			j = wl_rand(c) % i;
+			tmp = c->mem[i].next;
+			c->mem[i].next = c->mem[j].next;
+			c->mem[j].next = tmp;
+		}
+	return 0;
+}
+
+static inline void wl_free(struct wl_ctx *c)
+{
+	free(c->mem);
+	c->mem = NULL;
+}
+
+/*
+* Run n iterations of the kernel of the context.
+*/
+static inline void wl_run(struct wl_ctx *c, long n)
+{
+	uint64_t acc = 0, x;
+	size_t pos = c->pos;
+	uint32_t bits;
+	long i;
+	int j;
+
+	switch (c->kind) {
+	case WL_ALU:
+		x = c->rng;
+		for (i = 0; i < n; i++) {
+			x ^= x >> 12;
+			x ^= x << 25;
+			x ^= x >> 27;
+			acc += x * 0x2545f4914f6cdd1dULL;
+		}
+		c->rng = x;
+		break;
+	case WL_SIMD:
+		/* halfway to b at every pass: a stays within [0, 1) */
+		for (i = 0; i < n; i++)
+			for (j = 0; j < WL_SIMD_N; j++)
+				c->a[j] = c->a[j] * 0.5f + c->b[j] * 0.5f;
+		memcpy(&bits, &c->a[n & (WL_SIMD_N - 1)], sizeof(bits));
+		acc = bits;
+		break;
+	case WL_STREAM:
+		for (i = 0; i < n; i++) {
+			acc += c->mem[pos].val[0] + c->mem[pos].val[6];
+			if (++pos == c->nlines)
+				pos = 0;
+		}
+		break;
+	case WL_CHASE:
+		for (i = 0; i < n; i++)
+			pos = c->mem[pos].next;
+		acc = pos;
+		break;
+	}
+	c->pos = pos;
+	c->sink = acc;
+}
+
+/*
+* Time of one iteration of the kernel of the context, in ns: the best of a
+* few runs of at least a millisecond each, caches warm.
+*/
+static inline double wl_calibrate(struct wl_ctx *c)
+{
+	struct timespec t1, t2;
+	double ns, best = 0;	/* ns per iteration */
+	long n = 1000;
+	int r;
+
+	for (r = 0; r < 5; ) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+		wl_run(c, n);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t2);
+		ns = 1e9 * (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec);
+		if (ns < 1e6) {
+			n *= 2;		/* too short to time, start over */
+			continue;
+		}
+		if (r++ == 0 || ns / n < best)
+			best = ns / n;
+	}
+	return best;
+}
+
+#endif /* _WORKLOAD_H_ */